@@ -0,0 +1,23 @@
+// Buffer cache statistics, filled in by the bcstat() system call.
+// Both the kernel and user programs use this header file.
+
+#define BCSTAT_RESET  1   // bcstat() flag: zero the counters afterwards
+#define BCSTAT_DROP   2   // bcstat() flag: forget unused cached blocks
+
+#define BCPOLICY_LRU  0
+#define BCPOLICY_2Q   1
+
+struct bcstat {
+  int nbuf;          // Current number of buffers
+  int hiwat;         // High-water mark of nbuf
+  int maxbuf;        // Limit on nbuf
+  int policy;        // Replacement policy, BCPOLICY_*
+  int pinned;        // Buffers currently pinned by the log
+  uint64 lookups;    // Calls to bget()
+  uint64 hits;       // bread()s that found the block cached
+  uint64 misses;     // bread()s that had to read the disk
+  uint64 evictions;  // Cached blocks recycled for other blocks
+  uint64 pins;       // Calls to bpin()
+  uint64 lockwait;   // Timer cycles spent acquiring bucket locks
+  uint64 sleepwait;  // Timer cycles spent waiting for buffer locks
+};
@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,80 +12,645 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets,
+// each with its own spin-lock, so that lookups of different
+// blocks do not contend.  A bucket's lock protects the list
+// of buffers in the bucket and their dev, blockno and refcnt.
+// A buffer always lives in bucket BHASH(b->dev, b->blockno).
+// A process never holds more than one bucket lock, except
+// while moving a buffer between buckets or freeing a page of
+// buffers, when it acquires them in increasing bucket order.
+//
+// The cache starts with NBUF static buffers and grows on
+// demand, a page of buffers at a time, up to BCACHE_MAXPCT
+// percent of RAM.  When kalloc() runs out of memory it calls
+// bshrink() to give pages of unused buffers back.  The log
+// pins a transaction's blocks in the cache until they are
+// installed, so before it lets an FS system call start it has
+// breserve() grow the cache to hold them, and bshrink() leaves
+// that many buffers besides the static ones.
+//
+// Replacement is 2Q, so that one sequential scan cannot flush
+// frequently used blocks such as inodes, bitmaps and
+// directories.  A block enters the cache "cold".  Evicted cold
+// blocks are remembered in a ghost table; a block that misses
+// again while still remembered comes back "hot".  Cold buffers
+// are recycled first unless they are fewer than a quarter of
+// the cache.  Build with BCACHE=lru to get plain LRU instead.
 
 
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "bcstat.h"
 
-struct {
+#define NBUCKET 509
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+// Number of buckets bget() samples for an LRU victim
+// before settling for the best one seen.
+#define BSAMPLE 8
+
+// Don't grow the cache if fewer free pages than this remain.
+#define BCACHE_RESERVE 256
+
+// Number of (dev, blockno) keys of recently evicted
+// cold blocks that 2Q remembers.
+#define NGHOST 1024
+
+// A kalloc()ed page of buffers.
+#define BPERPAGE ((PGSIZE - sizeof(void*)) / sizeof(struct buf))
+struct bpage {
+  struct bpage *next;
+  struct buf buf[BPERPAGE];
+};
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
+  // Linked list of buffers in this bucket, through prev/next.
+  // Sorted by how recently the buffer was released.
   // head.next is most recent, head.prev is least.
   struct buf head;
+};
+
+struct {
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+
+  // Logical clock, stamped into b->lastuse whenever a
+  // buffer's refcnt drops to zero.  Stamps only increase,
+  // so a stamp identifies one period during which a buffer
+  // was unused.
+  uint64 clock;
+
+  // Protects the list of pages and the counts below.
+  // Acquired before any bucket lock.
+  struct spinlock sizelock;
+  struct bpage *pages; // dynamically allocated buffers
+  int nbuf;            // current number of buffers
+  int hiwat;           // high-water mark of nbuf
+  int maxbuf;          // limit on nbuf
+  int reserved;        // buffers promised by breserve()
+
+  // 2Q state, updated atomically.
+  int ncold;              // number of buffers not hot
+  uint64 ghost[NGHOST];   // direct-mapped table of evicted keys
+
+  // Statistics, updated atomically.  See bcstat.h.
+  int pinned;
+  uint64 lookups;
+  uint64 hits;
+  uint64 misses;
+  uint64 evictions;
+  uint64 pins;
+  uint64 lockwait;
+  uint64 sleepwait;
 } bcache;
 
+// Acquire a bucket lock, accounting for the time spent.
+static void
+bacquire(struct bucket *bk)
+{
+  uint64 t0 = r_time();
+
+  acquire(&bk->lock);
+  __sync_fetch_and_add(&bcache.lockwait, r_time() - t0);
+}
+
+// Acquire a buffer's sleep-lock, accounting for the time spent.
+static void
+bacquiresleep(struct buf *b)
+{
+  uint64 t0 = r_time();
+
+  acquiresleep(&b->lock);
+  __sync_fetch_and_add(&bcache.sleepwait, r_time() - t0);
+}
+
+static void
+bucket_insert(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+static void
+bucket_remove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Drop a reference to b.  Caller holds b's bucket lock.
+// If no one else is using it, stamp it and move it to
+// the head of the bucket's most-recently-used list.
+static void
+bunref(struct buf *b)
+{
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    b->lastuse = __sync_fetch_and_add(&bcache.clock, 1);
+    bucket_remove(b);
+    bucket_insert(&bcache.bucket[BHASH(b->dev, b->blockno)], b);
+  }
+}
+
+// Initialize a free buffer and put it in bucket h.
+// Its dev is 0, which is never looked up, and its
+// blockno is chosen to keep it in bucket h.
+static void
+binitbuf(struct buf *b, int h)
+{
+  initsleeplock(&b->lock, "buffer");
+  b->dev = 0;
+  b->blockno = h;
+  b->valid = 0;
+  b->disk = 0;
+  b->async = 0;
+  b->refcnt = 0;
+  b->lastuse = 0;
+  b->hot = 0;
+  bucket_insert(&bcache.bucket[h], b);
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
+
+  initlock(&bcache.sizelock, "bcache.size");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
 
-  initlock(&bcache.lock, "bcache");
+  // Spread the static buffers over the buckets.
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++)
+    binitbuf(b, (b - bcache.buf) % NBUCKET);
+  bcache.clock = 1;
+
+  bcache.nbuf = bcache.hiwat = bcache.ncold = NBUF;
+  bcache.maxbuf = NBUF +
+    (PHYSTOP - KERNBASE) / 100 * BCACHE_MAXPCT / PGSIZE * BPERPAGE;
+}
+
+// Add page pg of free buffers to bucket h.
+// Caller holds sizelock.
+static void
+baddpage(struct bpage *pg, int h)
+{
+  int i;
+
+  pg->next = bcache.pages;
+  bcache.pages = pg;
+  bcache.nbuf += BPERPAGE;
+  __sync_fetch_and_add(&bcache.ncold, BPERPAGE);
+  if(bcache.nbuf > bcache.hiwat)
+    bcache.hiwat = bcache.nbuf;
+  // Still holding sizelock, so bshrink() cannot see
+  // the page before its buffers are in the bucket.
+  bacquire(&bcache.bucket[h]);
+  for(i = 0; i < BPERPAGE; i++)
+    binitbuf(&pg->buf[i], h);
+  release(&bcache.bucket[h].lock);
+}
+
+// Add a page of free buffers to bucket h, if the cache
+// is allowed to grow and memory is not short.
+static void
+bgrow(int h)
+{
+  struct bpage *pg;
+
+  // Unlocked checks; rechecked below.
+  if(bcache.nbuf + BPERPAGE > bcache.maxbuf || kfreepages() < BCACHE_RESERVE)
+    return;
+  if((pg = kalloc()) == 0)
+    return;
+
+  acquire(&bcache.sizelock);
+  if(bcache.nbuf + BPERPAGE > bcache.maxbuf){
+    release(&bcache.sizelock);
+    kfree(pg);
+    return;
+  }
+  baddpage(pg, h);
+  release(&bcache.sizelock);
+}
+
+// Promise the log n more buffers, growing the cache if it
+// has fewer than NBUF besides those already promised.  The
+// reserve is for blocks the log may pin, so it dips below
+// BCACHE_RESERVE free pages if need be.  Returns 0, having
+// promised nothing, if the memory is not there.
+int
+breserve(int n)
+{
+  struct bpage *pg;
+  static int h;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  acquire(&bcache.sizelock);
+  while(bcache.nbuf < NBUF + bcache.reserved + n){
+    release(&bcache.sizelock);
+    if(bcache.nbuf + BPERPAGE > bcache.maxbuf || (pg = kalloc()) == 0)
+      return 0;
+    acquire(&bcache.sizelock);
+    // spread the pages over the buckets.
+    baddpage(pg, h);
+    h = (h + 1) % NBUCKET;
   }
+  bcache.reserved += n;
+  release(&bcache.sizelock);
+  return 1;
+}
+
+// Take back n buffers promised by breserve().
+void
+bunreserve(int n)
+{
+  acquire(&bcache.sizelock);
+  bcache.reserved -= n;
+  release(&bcache.sizelock);
+}
+
+// Try to free page pg, whose buffers must all be unused.
+// Caller holds sizelock.  Returns 1 if the buffers were
+// removed from their buckets and the page may be freed.
+static int
+bfreepage(struct bpage *pg)
+{
+  int held[BPERPAGE];  // bucket numbers, increasing
+  int i, j, h, n, ok;
+
+  // Lock the buckets the buffers appear to be in.
+  // dev and blockno may change until we hold the locks,
+  // so check again afterwards.  Runs from kalloc(), at any
+  // depth of kernel stack, so keeps just the few buckets.
+  n = 0;
+  for(i = 0; i < BPERPAGE; i++){
+    h = BHASH(pg->buf[i].dev, pg->buf[i].blockno);
+    for(j = n; j > 0 && held[j-1] > h; j--)
+      ;
+    if(j > 0 && held[j-1] == h)
+      continue;
+    memmove(&held[j+1], &held[j], (n - j) * sizeof(held[0]));
+    held[j] = h;
+    n++;
+  }
+  for(j = 0; j < n; j++)
+    bacquire(&bcache.bucket[held[j]]);
+
+  ok = 1;
+  for(i = 0; i < BPERPAGE; i++){
+    struct buf *b = &pg->buf[i];
+    h = BHASH(b->dev, b->blockno);
+    for(j = 0; j < n && held[j] != h; j++)
+      ;
+    if(j == n || b->refcnt != 0)
+      ok = 0;
+  }
+  if(ok){
+    for(i = 0; i < BPERPAGE; i++){
+      bucket_remove(&pg->buf[i]);
+      if(!pg->buf[i].hot)
+        __sync_fetch_and_sub(&bcache.ncold, 1);
+    }
+  }
+
+  for(j = n-1; j >= 0; j--)
+    release(&bcache.bucket[held[j]].lock);
+  return ok;
+}
+
+// Give up to npages pages of unused buffers back to
+// the page allocator.  Returns the number of pages freed.
+// Called by kalloc() when memory runs out.
+int
+bshrink(int npages)
+{
+  struct bpage **pp, *pg, *freed;
+  int n;
+
+  freed = 0;
+  n = 0;
+  acquire(&bcache.sizelock);
+  for(pp = &bcache.pages; *pp != 0 && n < npages; ){
+    pg = *pp;
+    if(bcache.nbuf - BPERPAGE < NBUF + bcache.reserved)
+      break;
+    if(bfreepage(pg)){
+      *pp = pg->next;
+      pg->next = freed;
+      freed = pg;
+      bcache.nbuf -= BPERPAGE;
+      n++;
+    } else {
+      pp = &pg->next;
+    }
+  }
+  release(&bcache.sizelock);
+
+  while((pg = freed) != 0){
+    freed = pg->next;
+    kfree(pg);
+  }
+  return n;
+}
+
+// Print the size and hit rate of the cache, for ^P.
+void
+bcachedump(void)
+{
+  uint64 n = bcache.hits + bcache.misses;
+
+  printf("bcache: %d buffers, high water %d, max %d\n",
+         bcache.nbuf, bcache.hiwat, bcache.maxbuf);
+  printf("bcache: %s, %d hits, %d misses, hit rate %d%%\n",
+#ifdef BCACHE_LRU
+         "lru",
+#else
+         "2q",
+#endif
+         (int)bcache.hits, (int)bcache.misses,
+         n ? (int)(bcache.hits * 100 / n) : 0);
+}
+
+// Invalidate every cached block that no one is using, so
+// that the next bread() of it goes to the disk.  Blocks the
+// log has pinned are in use, so no dirty data is lost.
+static void
+bdrop(void)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  for(bk = bcache.bucket; bk < &bcache.bucket[NBUCKET]; bk++){
+    bacquire(bk);
+    for(b = bk->head.next; b != &bk->head; b = b->next)
+      if(b->refcnt == 0)
+        b->valid = 0;
+    release(&bk->lock);
+  }
+}
+
+// Copy the cache statistics to *st.
+// If flags has BCSTAT_RESET, zero the counters.
+// If flags has BCSTAT_DROP, empty the cache first.
+void
+bcachestat(struct bcstat *st, int flags)
+{
+  if(flags & BCSTAT_DROP)
+    bdrop();
+
+  st->nbuf = bcache.nbuf;
+  st->hiwat = bcache.hiwat;
+  st->maxbuf = bcache.maxbuf;
+#ifdef BCACHE_LRU
+  st->policy = BCPOLICY_LRU;
+#else
+  st->policy = BCPOLICY_2Q;
+#endif
+  st->pinned = bcache.pinned;
+  st->lookups = bcache.lookups;
+  st->hits = bcache.hits;
+  st->misses = bcache.misses;
+  st->evictions = bcache.evictions;
+  st->pins = bcache.pins;
+  st->lockwait = bcache.lockwait;
+  st->sleepwait = bcache.sleepwait;
+
+  if(flags & BCSTAT_RESET){
+    bcache.hiwat = bcache.nbuf;
+    bcache.lookups = bcache.hits = bcache.misses = 0;
+    bcache.evictions = bcache.pins = 0;
+    bcache.lockwait = bcache.sleepwait = 0;
+  }
+}
+
+#ifndef BCACHE_LRU
+#define GHOSTKEY(dev, blockno) (((uint64)(dev) << 32) | (blockno))
+
+// Remember that block (dev, blockno) was evicted while cold.
+static void
+ghost_add(uint dev, uint blockno)
+{
+  bcache.ghost[((dev) * 31 + (blockno)) % NGHOST] = GHOSTKEY(dev, blockno);
+}
+
+// Was block (dev, blockno) recently evicted while cold?
+// If so, forget it and return 1.
+static int
+ghost_take(uint dev, uint blockno)
+{
+  uint64 *g = &bcache.ghost[((dev) * 31 + (blockno)) % NGHOST];
+
+  // dev 0 is never looked up, so a zero key never matches.
+  return __sync_bool_compare_and_swap(g, GHOSTKEY(dev, blockno), 0);
+}
+#endif
+
+// Choose a buffer to recycle for a block that hashes to
+// bucket h, holding one bucket lock at a time.  Each
+// bucket's least recently used unused buffers are the ones
+// nearest its tail; sample BSAMPLE buckets starting at h,
+// and look further only if all are busy.  Returns the
+// buffer and sets *vh to its bucket and *stamp to its
+// lastuse at the time it was chosen, or returns 0.
+static struct buf*
+bvictim(int h, int *vh, uint64 *stamp)
+{
+  struct buf *b, *v[2];
+  uint64 vs[2];
+  int i, n, hot, vb[2], seen[2];
+
+  v[0] = v[1] = 0;  // best cold and hot candidates
+  vb[0] = vb[1] = 0;
+  vs[0] = vs[1] = 0;
+  for(n = 0; n < NBUCKET && ((v[0] == 0 && v[1] == 0) || n < BSAMPLE); n++){
+    i = (h + n) % NBUCKET;
+    bacquire(&bcache.bucket[i]);
+    seen[0] = 0;
+#ifdef BCACHE_LRU
+    seen[1] = 1;  // no buffer is ever hot
+#else
+    seen[1] = 0;
+#endif
+    for(b = bcache.bucket[i].head.prev; b != &bcache.bucket[i].head; b = b->prev){
+      if(b->refcnt != 0)
+        continue;
+      hot = b->hot;
+      if(seen[hot])
+        continue;
+      seen[hot] = 1;
+      if(v[hot] == 0 || b->lastuse < vs[hot]){
+        v[hot] = b;
+        vb[hot] = i;
+        vs[hot] = b->lastuse;
+      }
+      if(seen[0] && seen[1])
+        break;
+    }
+    release(&bcache.bucket[i].lock);
+  }
+
+  // Recycle cold buffers while they are more than a quarter
+  // of the cache, or when no hot buffer is free.
+  hot = v[1] != 0 && (v[0] == 0 || bcache.ncold <= bcache.nbuf / 4);
+  *vh = vb[hot];
+  *stamp = vs[hot];
+  return v[hot];
+}
+
+// Look for block on device dev in bucket bk.
+// Caller must hold bk->lock.
+static struct buf*
+bucket_find(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
+
+// Is buffer b on bucket bk's list?
+// Caller must hold bk->lock.
+static int
+bucket_has(struct bucket *bk, struct buf *b)
+{
+  struct buf *x;
+
+  for(x = bk->head.next; x != &bk->head; x = x->next){
+    if(x == b)
+      return 1;
+  }
+  return 0;
+}
+
+// Acquire the locks of buckets i and j in increasing order.
+static void
+acquire2(int i, int j)
+{
+  if(i > j){
+    int t = i;
+    i = j;
+    j = t;
+  }
+  bacquire(&bcache.bucket[i]);
+  if(i != j)
+    bacquire(&bcache.bucket[j]);
+}
+
+static void
+release2(int i, int j)
+{
+  release(&bcache.bucket[i].lock);
+  if(i != j)
+    release(&bcache.bucket[j].lock);
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
-// In either case, return locked buffer.
+// In either case, return locked buffer, except that
+// if nowait is set and the block is cached, return 0.
+// A cached block that bdrop() invalidated and no one is
+// using counts as not cached, so that readahead reads it.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int nowait)
 {
-  struct buf *b;
+  struct buf *b, *victim;
+  struct bucket *bk;
+  uint64 stamp;
+  int h, vh;
 
-  acquire(&bcache.lock);
+  h = BHASH(dev, blockno);
+  bk = &bcache.bucket[h];
+  __sync_fetch_and_add(&bcache.lookups, 1);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  bacquire(bk);
+  if((b = bucket_find(bk, dev, blockno)) != 0){
+    if(nowait && (b->refcnt != 0 || b->valid)){
+      release(&bk->lock);
+      return 0;
     }
+    b->refcnt++;
+    release(&bk->lock);
+    bacquiresleep(b);
+    return b;
   }
+  release(&bk->lock);
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  // Grow the cache if allowed, then recycle the least
+  // recently used (LRU) unused buffer, which may live
+  // in any bucket.
+  bgrow(h);
+  for(;;){
+    if((victim = bvictim(h, &vh, &stamp)) == 0)
+      panic("bget: no buffers");
+
+    acquire2(h, vh);
+
+    // Another process may have cached the block meanwhile.
+    if((b = bucket_find(bk, dev, blockno)) != 0){
+      if(nowait && (b->refcnt != 0 || b->valid)){
+        release2(h, vh);
+        return 0;
+      }
+      b->refcnt++;
+      release2(h, vh);
+      bacquiresleep(b);
       return b;
     }
+
+    // bshrink() may have freed the victim's page since
+    // bvictim() let go of bucket vh, so don't touch it unless
+    // it is still on vh's list.  Otherwise it can only have
+    // been recycled, and every drop of refcnt to zero gives
+    // it a new stamp; if the stamp is unchanged, the victim
+    // is still unused.
+    if(bucket_has(&bcache.bucket[vh], victim) &&
+       victim->refcnt == 0 && victim->lastuse == stamp)
+      break;
+    release2(h, vh);
+  }
+
+  if(victim->valid)
+    __sync_fetch_and_add(&bcache.evictions, 1);
+#ifndef BCACHE_LRU
+  int hot = ghost_take(dev, blockno);
+  if(!victim->hot && victim->valid)
+    ghost_add(victim->dev, victim->blockno);
+  if(hot != victim->hot){
+    __sync_fetch_and_add(&bcache.ncold, hot ? -1 : 1);
+    victim->hot = hot;
   }
-  panic("bget: no buffers");
+#endif
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  bucket_remove(victim);
+  bucket_insert(bk, victim);
+  release2(h, vh);
+  acquiresleep(&victim->lock);
+  return victim;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,60 +659,248 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    __sync_fetch_and_add(&bcache.misses, 1);
+    iosched_rw(b, 0);
     b->valid = 1;
+  } else {
+    __sync_fetch_and_add(&bcache.hits, 1);
+  }
+  return b;
+}
+
+// Start reading locked buffer b from disk without waiting.
+// b's lock and reference pass to the disk driver, which
+// calls biodone() when the read finishes.
+static void
+bstartread(struct buf *b)
+{
+  b->async = 1;
+  iosched_submit(b, 0);
+}
+
+// Start reading blocks start..start+n-1 into the cache, for
+// readahead, skipping blocks that are already cached.  The
+// blocks go to the disk together, so that runs of them that
+// are not cached are read with one request each.
+void
+bprefetch_range(uint dev, uint start, int n)
+{
+  struct buf *run[16];
+  struct buf *b;
+  int i, k = 0;
+
+  for(i = 0; i < n; i++){
+    if((b = bget(dev, start + i, 1)) != 0){
+      b->async = 1;
+      run[k++] = b;
+    }
+    if(k == NELEM(run) || (k > 0 && i == n - 1)){
+      iosched_submitv(run, k, 0);
+      k = 0;
+    }
+  }
+}
+
+// Return locked bufs with the contents of blocks
+// start..start+n-1 in bufs[0..n-1].  The blocks that are
+// not cached are read with as few disk requests as possible,
+// all in flight at once.  Release each with brelse().
+void
+bread_range(uint dev, uint start, int n, struct buf **bufs)
+{
+  int i, j;
+
+  for(i = 0; i < n; i++)
+    bufs[i] = bget(dev, start + i, 0);
+
+  for(i = 0; i < n; i = j){
+    if(bufs[i]->valid){
+      __sync_fetch_and_add(&bcache.hits, 1);
+      j = i + 1;
+      continue;
+    }
+    for(j = i; j < n && !bufs[j]->valid; j++)
+      __sync_fetch_and_add(&bcache.misses, 1);
+    iosched_submitv(&bufs[i], j - i, 0);
+  }
+
+  for(i = 0; i < n; i++){
+    if(!bufs[i]->valid){
+      iosched_wait(bufs[i]);
+      bufs[i]->valid = 1;
+    }
+  }
+}
+
+// Return a locked buf with the contents of the indicated
+// block if they are cached and no one holds the buffer;
+// otherwise return 0.  Never sleeps.
+struct buf*
+btryget(uint dev, uint blockno)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct buf *b;
+
+  __sync_fetch_and_add(&bcache.lookups, 1);
+  bacquire(bk);
+  if((b = bucket_find(bk, dev, blockno)) == 0 || !tryacquiresleep(&b->lock)){
+    release(&bk->lock);
+    return 0;
   }
+  b->refcnt++;
+  release(&bk->lock);
+  if(!b->valid){
+    brelse(b);
+    return 0;
+  }
+  __sync_fetch_and_add(&bcache.hits, 1);
   return b;
 }
 
+// Return a locked buf with the contents of the indicated
+// block if they are cached and no one holds the buffer, say
+// while a read of it is in flight.  Otherwise return 0, and
+// start reading the block if it is not cached.  Never sleeps.
+struct buf*
+bpeek(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = btryget(dev, blockno)) != 0)
+    return b;
+  if((b = bget(dev, blockno, 1)) != 0)
+    bstartread(b);
+  return 0;
+}
+
+// Called by the disk driver when a read started by
+// bstartread() has finished.  Releases b on behalf of
+// the process that started the read.
+void
+biodone(struct buf *b)
+{
+  struct bucket *bk;
+
+  b->valid = 1;
+  b->async = 0;
+  releasesleep(&b->lock);
+
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  bacquire(bk);
+  bunref(b);
+  release(&bk->lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  iosched_rw(b, 1);
+}
+
+// Start writing b's contents to disk, without waiting.
+// Must be locked, and must stay locked until bwait(b).
+// Lets callers keep many writes in flight at once.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  iosched_submit(b, 1);
+}
+
+// Wait for the write started by bwrite_async(b).
+void
+bwait(struct buf *b)
+{
+  iosched_wait(b);
+}
+
+// Write the n locked bufs in bufs[] to disk and wait.  The
+// writes are queued together, so that the scheduler can sort
+// them and merge runs of consecutive blocks.
+void
+bwritev(struct buf **bufs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwritev");
+  iosched_submitv(bufs, n, 1);
+  for(i = 0; i < n; i++)
+    iosched_wait(bufs[i]);
+}
+
+// Start writing the n locked bufs in bufs[], as for
+// bwrite_async().
+void
+bwritev_async(struct buf **bufs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwritev_async");
+  iosched_submitv(bufs, n, 1);
+}
+
+// Make the blocks written so far durable, even if the
+// disk has a write-back cache.
+void
+bflush(uint dev)
+{
+  iosched_flush(dev);
+}
+
+// Tell the disk that n blocks from blockno no longer hold
+// anything of value, so that it may release their space.
+// Cached copies are not affected.
+void
+bdiscard(uint dev, uint blockno, uint n)
+{
+  iosched_discard(dev, blockno, n);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  // b->dev and b->blockno cannot change while we hold a reference.
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  bacquire(bk);
+  bunref(b);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  bacquire(bk);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
+  __sync_fetch_and_add(&bcache.pins, 1);
+  __sync_fetch_and_add(&bcache.pinned, 1);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
-}
-
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
 
+  bacquire(bk);
+  bunref(b);
+  release(&bk->lock);
+  __sync_fetch_and_sub(&bcache.pinned, 1);
+}
@@ -1,12 +1,24 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int async;   // release buf with biodone() when the disk is done
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint64 lastuse;   // bcache clock at last release, for LRU
+  int hot;          // 2Q: re-referenced soon after eviction
+  struct buf *prev; // hash bucket list
   struct buf *next;
+  struct buf *qnext; // next block of the same disk request
+  int qwrite;        // disk request is a write
+  int qid;           // disk queue the request was submitted to
+  // the rest are only used in the first buf of a request.
+  struct buf *rqnext; // next request in iosched queue
+  struct buf *qtail;  // last buf of the request
+  int nseg;           // number of bufs in the request
+  uint64 deadline;    // r_time() by which to dispatch it
+  uint64 iostart;     // r_time() when handed to the disk
   uchar data[BSIZE];
 };
 
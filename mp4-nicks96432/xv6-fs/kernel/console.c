@@ -138,8 +138,9 @@ consoleintr(int c)
   acquire(&cons.lock);
 
   switch(c){
-  case C('P'):  // Print process list.
+  case C('P'):  // Print process list and buffer cache size.
     procdump();
+    bcachedump();
     break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
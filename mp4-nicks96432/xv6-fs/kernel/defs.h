@@ -1,6 +1,9 @@
+struct bcstat;
 struct buf;
 struct context;
+struct dstat;
 struct file;
+struct fsstat;
 struct inode;
 struct pipe;
 struct proc;
@@ -16,6 +19,22 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(int);
+int             breserve(int);
+void            bunreserve(int);
+void            bwrite_async(struct buf*);
+void            bwait(struct buf*);
+void            bwritev(struct buf**, int);
+void            bwritev_async(struct buf**, int);
+void            bflush(uint);
+void            bdiscard(uint, uint, uint);
+void            bprefetch_range(uint, uint, int);
+void            bread_range(uint, uint, int, struct buf**);
+struct buf*     btryget(uint, uint);
+struct buf*     bpeek(uint, uint);
+void            biodone(struct buf*);
+void            bcachedump(void);
+void            bcachestat(struct bcstat*, int);
 
 // console.c
 void            consoleinit(void);
@@ -36,6 +55,8 @@ int             filewrite(struct file*, uint64, int n);
 
 // fs.c
 void            fsinit(int);
+void            fsstat(struct fsstat*, int);
+void            bunhold(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
@@ -46,6 +67,7 @@ void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+void            igroup(struct inode*, struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
@@ -59,16 +81,36 @@ void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// iosched.c
+void            iosched_init(void);
+void            iosched_submit(struct buf*, int);
+void            iosched_submitv(struct buf**, int, int);
+void            iosched_wait(struct buf*);
+void            iosched_rw(struct buf*, int);
+void            iosched_done(int, int);
+void            iosched_flush(uint);
+void            iosched_discard(uint, uint, uint);
+
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+int             kfreepages(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_data(struct buf*);
+uint            log_seq(void);
+void            log_wait(uint);
+void            log_tick(void);
+int             log_free(uint);
+void            log_alloc(uint);
 void            begin_op(void);
 void            end_op(void);
+void            begin_opn(int);
+void            end_opn(int);
+int             log_opmax(void);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -90,6 +132,7 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+void            kthread(void (*)(void), char*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -119,6 +162,7 @@ void            pop_off(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
@@ -181,8 +225,15 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_nqueue(void);
+int             virtio_disk_maxseg(void);
+int             virtio_disk_start(int, struct buf *, int, int);
+void            virtio_disk_notify(int);
+void            virtio_disk_flush(int);
+void            virtio_disk_discard(int, uint, uint);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
+void            virtio_disk_stat(struct dstat*, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
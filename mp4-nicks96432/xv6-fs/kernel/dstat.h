@@ -0,0 +1,31 @@
+// Disk statistics, filled in by the dstat() system call.
+// Both the kernel and user programs use this header file.
+
+#define DSTAT_RESET    1   // dstat() flag: zero the counters afterwards
+#define DSTAT_POLL_ON  2   // dstat() flag: wait for the disk by polling
+#define DSTAT_POLL_OFF 4   // dstat() flag: wait for the disk interrupt
+
+// Latency histogram buckets.  Bucket i counts requests that
+// took [2^i, 2^(i+1)) timer cycles; the last bucket also
+// counts everything slower.
+#define DSTAT_NHIST 24
+
+struct dstat {
+  int poll;                   // Polling enabled?
+  int pollcycles;             // Timer cycles a waiter polls before sleeping
+  int event_idx;              // Device suppresses notifications/interrupts?
+  int version;                // virtio-mmio version: 1 legacy, 2 modern
+  int packed;                 // Packed (vs split) virtqueue?
+  int nqueue;                 // Number of virtqueues
+  int flush;                  // Device has a write-back cache to flush?
+  int discard;                // Device accepts discards?
+  uint64 requests;            // Requests handed to the device
+  uint64 flushes;             // Flush requests
+  uint64 discards;            // Discard requests
+  uint64 notifies;            // Writes to the queue notify register
+  uint64 intrs;               // Disk interrupts
+  uint64 pollhits;            // Waits that ended while polling
+  uint64 pollmisses;          // Polled waits that had to sleep
+  uint64 waits;               // Waits counted in hist[]
+  uint64 hist[DSTAT_NHIST];   // Latency from device submit to waiter running
+};
@@ -13,6 +13,8 @@
 #include "stat.h"
 #include "proc.h"
 
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
@@ -129,6 +131,37 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// The most log blocks a write of nd blocks' worth of bytes
+// may need: the blocks themselves and a bitmap block for each
+// (though there are only so many bitmap blocks), an indirect
+// or extent tree block per EPB of them and a path down the
+// tree, the i-node, and 2 blocks of slop for non-aligned writes.
+static int
+writeblocks(int nd)
+{
+  return nd + min(nd, FSSIZE / BPB + 1) + nd / EPB + EXTDEPTH + 1 + 1 + 2;
+}
+
+// The most blocks one transaction of filewrite() can write:
+// the largest nd, but at least 1, for which writeblocks(nd)
+// fits in what one op may reserve.  writeblocks() only grows
+// with nd, so binary search for it.
+static int
+maxwrite(void)
+{
+  int opmax = log_opmax();
+  int lo = 1, hi = opmax, mid;
+
+  while(lo < hi){
+    mid = lo + (hi - lo + 1) / 2;
+    if(writeblocks(mid) <= opmax)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
@@ -146,25 +179,25 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write as many blocks at a time as one transaction
+    // may reserve, so that a large write is a few
+    // transactions rather than hundreds.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = maxwrite() * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
+      int res = writeblocks((n1 + BSIZE - 1) / BSIZE);
 
-      begin_op();
+      begin_opn(res);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opn(res);
 
       if(r != n1){
         // error from writei
@@ -20,11 +20,19 @@ struct inode {
   int ref;            // Reference count
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ra_next;       // readahead: block after the last one read
+  uint ra_win;        // readahead: window size in blocks, 0 if off
+  uint ra_end;        // readahead: started up to this block
+  uint seq;           // last log transaction that changed the inode
+  uint dseq;          // last transaction that changed its data or size
+  int group;          // allocation group for its first block, or -1
+  uint lastb;         // last block allocated to it, or 0 if unknown
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
+  uchar flags;
   uint size;
   uint addrs[NDIRECT+1+NDOUBLEINDIRECT]; // TODO: bigfile. If you modify dinode, don't forget here.
 };
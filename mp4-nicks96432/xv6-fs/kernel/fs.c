@@ -20,8 +20,14 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "fsstat.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// Readahead window bounds, in blocks.
+#define RA_MIN 4
+#define RA_MAX 64
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -37,6 +43,8 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bsuminit(int);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,53 +52,399 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);  // after recovery, which may change the bitmap
 }
 
-// Zero a block.
+// Zero a block, which holds file data if data is set.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
   bp = bread(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if(data)
+    log_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// Besides the bitmap on disk, the allocator keeps a summary
+// in memory: how many free blocks each bitmap block covers,
+// and where the last allocation left off.  balloc() starts
+// looking at a goal block, or there (next fit), skips bitmap
+// blocks with nothing free without reading them, and scans
+// the bitmap 64 bits at a time.
+//
+// The goal keeps a file together: it is the block after the
+// last one the file was given.  If that is taken, say by
+// another file being written at the same time, balloc() looks
+// for 64 free blocks in a row in the goal's group, so that
+// the file can carry on there undisturbed; failing that, for
+// any free block, next fit.  A file's first block goes in its
+// directory's group, and a new directory in the group with
+// the most room; see igroup().
+//
+// The counts track the cached bitmap, changes of uncommitted
+// transactions included, except that with FS_ORDERED a freed
+// block only counts once its transaction commits; see bfree().
+// They change under bsum.lock, as the bits change under the
+// bitmap block's.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+#define NBMAP (FSSIZE / BPB + 1)  // max bitmap blocks
+
+struct {
+  struct spinlock lock;
+  int nbmap;          // bitmap blocks in use
+  uint nfree[NBMAP];  // free blocks each one covers
+  uint next;          // block # to start looking at
+  uint64 allocs;      // statistics, for fsstat()
+  uint64 alloctime;
+  uint64 bmscans;
+  // With FS_ORDERED, blocks freed by each in-memory transaction,
+  // held back from reuse until it commits; see bfree().
+  uint64 held[2][NBMAP * BPB / 64];
+  int nheld[2];
+} bsum;
+
+// Which blocks of word k of the bitmap are held back.
+static uint64
+bheld(int k)
+{
+  return bsum.held[0][k] | bsum.held[1][k];
+}
+
+// Index of the lowest set bit of x, which is not 0.
+static int
+ctz64(uint64 x)
+{
+  int n = 0;
+
+  if((x & 0xffffffff) == 0){ n += 32; x >>= 32; }
+  if((x & 0xffff) == 0){ n += 16; x >>= 16; }
+  if((x & 0xff) == 0){ n += 8; x >>= 8; }
+  if((x & 0xf) == 0){ n += 4; x >>= 4; }
+  if((x & 0x3) == 0){ n += 2; x >>= 2; }
+  if((x & 0x1) == 0)
+    n += 1;
+  return n;
+}
+
+// Count the free blocks of each bitmap block.
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  int i, bi;
+
+  initlock(&bsum.lock, "bsum");
+  bsum.nbmap = (sb.size + BPB - 1) / BPB;
+  if(bsum.nbmap > NBMAP)
+    panic("bsuminit: file system too big");
+  for(i = 0; i < bsum.nbmap; i++){
+    bp = bread(dev, sb.bmapstart + i);
+    bsum.nfree[i] = 0;
+    for(bi = 0; bi < BPB && i*BPB + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[i]++;
+    brelse(bp);
+  }
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+// Find a free block at or after bit first of bitmap block
+// bp, which covers blocks from base; return its bit, or -1.
+// With run, find the first of 64 free blocks, 64-aligned.
+static int
+bscan(struct buf *bp, uint base, int first, int run)
+{
+  uint64 *w = (uint64*)bp->data;
+  uint64 x;
+  int i, bi;
+
+  // little-endian, so bit j of w[i] is bit i*64+j of the map.
+  for(i = first / 64; i < BSIZE / 8; i++){
+    if(run){
+      if((w[i] | bheld(base / 64 + i)) != 0 ||
+         (i == first / 64 && first % 64 != 0))
+        continue;
+      bi = i * 64;
+      return base + bi + 63 < sb.size ? bi : -1;
     }
+    x = ~(w[i] | bheld(base / 64 + i));
+    if(i == first / 64)
+      x &= ~0ULL << (first % 64);
+    if(x == 0)
+      continue;
+    bi = i * 64 + ctz64(x);
+    // bits past the end of the disk are clear, not free.
+    return base + bi < sb.size ? bi : -1;
+  }
+  return -1;
+}
+
+// Mark bit bi of locked bitmap block bp, which covers blocks
+// from base, allocated, and zero the block.  Returns its #.
+static uint
+bclaim(uint dev, struct buf *bp, uint base, int bi, int data)
+{
+  uint b = base + bi;
+
+  bp->data[bi/8] |= 1 << (bi % 8);
+  log_write(bp);
+  brelse(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b / BPB]--;
+  bsum.next = b + 1 < sb.size ? b + 1 : 0;
+  release(&bsum.lock);
+  log_alloc(b);
+  bzero(dev, b, data);
+  return b;
+}
+
+// Take a block that an uncommitted transaction freed, for
+// when there is no other.  Written in place, its new contents
+// could end up in the old file after a crash, so it is logged
+// as metadata, whatever it holds: then it only reaches its
+// home once this transaction commits, after the one that
+// freed it.  Returns its #, or 0 if none is held (any more).
+static uint
+breuse(uint dev)
+{
+  struct buf *bp;
+  uint64 m;
+  uint b;
+  int t, k;
+
+  b = 0;
+  acquire(&bsum.lock);
+  for(t = 0; t < 2 && b == 0; t++)
+    for(k = 0; bsum.nheld[t] > 0 && k < bsum.nbmap * BPB / 64; k++)
+      if(bsum.held[t][k] != 0){
+        b = k * 64 + ctz64(bsum.held[t][k]);
+        break;
+      }
+  release(&bsum.lock);
+  if(b == 0)
+    return 0;
+
+  bp = bread(dev, BBLOCK(b, sb));
+  m = 1ULL << (b % 64);
+  acquire(&bsum.lock);
+  for(t = 0; t < 2; t++)
+    if(bsum.held[t][b / 64] & m)
+      break;
+  if(t == 2){
+    // bunhold() let it go meanwhile.
+    release(&bsum.lock);
     brelse(bp);
+    return 0;
   }
+  bsum.held[t][b / 64] &= ~m;
+  bsum.nheld[t]--;
+  release(&bsum.lock);
+  bp->data[(b % BPB) / 8] |= 1 << (b % 8);
+  log_write(bp);
+  brelse(bp);
+  log_alloc(b);
+  bzero(dev, b, 0);
+  return b;
+}
+
+static uint bgrab(uint, uint, int);
+
+// Look through bitmap blocks lo..hi-1 for a free block, or
+// with run for a free run, starting at block start: start's
+// bitmap block, the ones after it, and then the first part of
+// start's again.  Blocks with too few free are skipped without
+// being read.  Claims the block and returns its #, or 0.
+static uint
+bsweep(uint dev, int lo, int hi, uint start, int run, int data)
+{
+  struct buf *bp;
+  uint base;
+  int i, g, bi, first, nfree;
+
+  for(i = 0; i <= hi - lo; i++){
+    g = lo + (start / BPB - lo + i) % (hi - lo);
+    first = i == 0 ? start % BPB : 0;
+    acquire(&bsum.lock);
+    nfree = bsum.nfree[g];
+    release(&bsum.lock);
+    if(nfree < (run ? 64 : 1))
+      continue;
+    base = g * BPB;
+    bp = bread(dev, sb.bmapstart + g);
+    __sync_fetch_and_add(&bsum.bmscans, 1);
+    if((bi = bscan(bp, base, first, run)) >= 0)
+      return bclaim(dev, bp, base, bi, data);
+    brelse(bp);
+  }
+  return 0;
+}
+
+// Allocate a zeroed disk block, for file data if data is set,
+// at goal if it is free, else at the next free run in goal's
+// group; failing that, or with no goal, next fit.
+static uint
+balloc(uint dev, int data, uint goal)
+{
+  uint64 t0;
+  uint start;
+  int g, lo, hi, bi, left;
+
+  t0 = r_time();
+again:
+  bi = bgrab(dev, goal, data);
+  if(bi == 0 && goal != 0 && goal < sb.size){
+    lo = BGROUP(goal) * GROUPBMAP;
+    hi = min(lo + GROUPBMAP, bsum.nbmap);
+    start = goal + 63 - (goal + 63) % 64;
+    if(start >= sb.size || BGROUP(start) != BGROUP(goal))
+      start = lo * BPB;
+    bi = bsweep(dev, lo, hi, start, 1, data);
+  }
+  if(bi == 0){
+    acquire(&bsum.lock);
+    start = bsum.next;
+    release(&bsum.lock);
+    bi = bsweep(dev, 0, bsum.nbmap, start, 0, data);
+  }
+  if(bi == 0)
+    bi = breuse(dev);
+  if(bi != 0){
+    __sync_fetch_and_add(&bsum.allocs, 1);
+    __sync_fetch_and_add(&bsum.alloctime, r_time() - t0);
+    return bi;
+  }
+  // none held either, unless bunhold() just freed them.
+  acquire(&bsum.lock);
+  left = bsum.nheld[0] + bsum.nheld[1];
+  for(g = 0; g < bsum.nbmap; g++)
+    left += bsum.nfree[g];
+  release(&bsum.lock);
+  if(left > 0)
+    goto again;
   panic("balloc: out of blocks");
 }
 
+// Where ip's next block should go: after the last one it
+// was given, else at the start of its group, else anywhere.
+// (Block 0 is the boot block, so a goal of 0 means none.)
+static uint
+bgoal(struct inode *ip)
+{
+  if(ip->lastb)
+    return ip->lastb + 1;
+  if(ip->group >= 0)
+    return max(ip->group * BPG, 1);
+  return 0;
+}
+
+// Allocate a block for ip, for file data if data is set.
+static uint
+bnew(struct inode *ip, int data)
+{
+  ip->lastb = balloc(ip->dev, data, bgoal(ip));
+  return ip->lastb;
+}
+
+// The number of the first block of ip, or 0 if it has none.
+static uint
+bfirst(struct inode *ip)
+{
+  return ip->addrs[0];  // the first extent starts there too
+}
+
+// Choose the allocation group for the blocks of new inode ip,
+// to be linked into directory dp: dp's group, or for a new
+// directory, the group with the most free blocks, so that
+// directories spread out and their files have room near them.
+// Caller must hold both locks.
+void
+igroup(struct inode *ip, struct inode *dp)
+{
+  int g, i, best, ng;
+  uint nfree, most;
+
+  if(ip->type != T_DIR){
+    if(dp->group >= 0)
+      ip->group = dp->group;
+    else if(bfirst(dp))
+      ip->group = BGROUP(bfirst(dp));
+    return;
+  }
+
+  ng = (sb.size + BPG - 1) / BPG;
+  best = 0;
+  most = 0;
+  acquire(&bsum.lock);
+  for(g = 0; g < ng; g++){
+    nfree = 0;
+    for(i = g * GROUPBMAP; i < (g + 1) * GROUPBMAP && i < bsum.nbmap; i++)
+      nfree += bsum.nfree[i];
+    if(nfree > most){
+      most = nfree;
+      best = g;
+    }
+  }
+  release(&bsum.lock);
+  ip->group = best;
+}
+
+// Copy the allocator statistics to *st.
+// If flags has FSSTAT_RESET, zero the counters.
+void
+fsstat(struct fsstat *st, int flags)
+{
+  int i;
+
+  acquire(&bsum.lock);
+  st->size = sb.size;
+  st->nfree = 0;
+  for(i = 0; i < bsum.nbmap; i++)
+    st->nfree += bsum.nfree[i];
+  st->allocs = bsum.allocs;
+  st->alloctime = bsum.alloctime;
+  st->bmscans = bsum.bmscans;
+  if(flags & FSSTAT_RESET)
+    bsum.allocs = bsum.alloctime = bsum.bmscans = 0;
+  release(&bsum.lock);
+}
+
+// Allocate block b, zeroed, if it is free; for file data if
+// data is set.  Returns b, or 0 if it is in use or not a block.
+static uint
+bgrab(uint dev, uint b, int data)
+{
+  struct buf *bp;
+  int bi, m;
+
+  if(b == 0 || b >= sb.size)
+    return 0;
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  if((bp->data[bi/8] & m) || (bheld(b / 64) >> (b % 64)) & 1){
+    brelse(bp);
+    return 0;
+  }
+  return bclaim(dev, bp, b - bi, bi, data);
+}
+
 // Free a disk block.
+// With FS_ORDERED, data is written in place, so a block must
+// not go to another file before the transaction that freed it
+// commits: a crash would leave the other file's data in the
+// file that, on disk, still owns it.  So the block is held
+// back, and only counted free once bunhold() lets it go.
 static void
 bfree(int dev, uint b)
 {
   struct buf *bp;
-  int bi, m;
+  int bi, m, t;
 
   bp = bread(dev, BBLOCK(b, sb));
   bi = b % BPB;
@@ -99,9 +453,41 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  t = log_free(b);
+  acquire(&bsum.lock);
+  if(sb.flags & FS_ORDERED){
+    // under bp's lock, so bscan() sees the bit and the hold
+    // change together.
+    bsum.held[t][b / 64] |= 1ULL << (b % 64);
+    bsum.nheld[t]++;
+  } else {
+    bsum.nfree[b / BPB]++;
+  }
+  release(&bsum.lock);
   brelse(bp);
 }
 
+// The transaction in log slot t has committed; the blocks it
+// freed may be reused now.
+void
+bunhold(int t)
+{
+  uint64 x;
+  int k, n;
+
+  acquire(&bsum.lock);
+  for(k = 0; bsum.nheld[t] > 0 && k < bsum.nbmap * BPB / 64; k++){
+    if((x = bsum.held[t][k]) == 0)
+      continue;
+    bsum.held[t][k] = 0;
+    for(n = 0; x != 0; n++)
+      x &= x - 1;
+    bsum.nfree[k * 64 / BPB] += n;
+    bsum.nheld[t] -= n;
+  }
+  release(&bsum.lock);
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -205,6 +591,8 @@ ialloc(uint dev, short type)
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if((sb.flags & FS_EXTENT) && (type == T_FILE || type == T_DIR))
+        dip->flags = DI_EXTENT;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
@@ -228,12 +616,14 @@ iupdate(struct inode *ip)
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
+  dip->flags = ip->flags;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
+  ip->seq = log_seq();
 }
 
 // Find the inode with number inum on device dev
@@ -267,6 +657,12 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ra_next = ip->ra_win = ip->ra_end = 0;
+  ip->group = -1;
+  ip->lastb = 0;
+  // changes made while the inode was not in the table
+  // can be no older than the current transaction.
+  ip->seq = ip->dseq = log_seq();
   release(&itable.lock);
 
   return ip;
@@ -301,6 +697,7 @@ ilock(struct inode *ip)
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
+    ip->flags = dip->flags;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
@@ -372,6 +769,243 @@ iunlockput(struct inode *ip)
 // are listed in ip->addrs[].  The single indirect blocks are
 // listed in block ip->addrs[NDIRECT]. The double indirect
 // blocks are listed in block ip->addrs[NDIRECT + i]
+//
+// An inode with DI_EXTENT maps its blocks by extent instead;
+// see fs.h.  Files have no holes, and only grow at the end,
+// so an extent needs no file offset: extent i starts where
+// extent i-1 ends.  A file written in one go maps with an
+// extent or two in the inode, and a block can be found
+// without reading anything; only a file with more than
+// NEXTENT extents has a tree, which grows at its right edge
+// as the file does.
+
+// Return the disk block holding block bn of extent-mapped
+// ip, or 0 if the file has no block bn.  With peek, as for
+// bmap_ra(): return 0 rather than wait for a tree block.
+static uint
+elookup(struct inode *ip, uint bn, int peek)
+{
+  struct extent *e = (struct extent*)ip->addrs;
+  struct extblock *eb;
+  struct buf *bp;
+  uint b;
+  int i, leaf;
+
+  for(i = 0; i < NEXTENT && e[i].len; i++){
+    if(bn < e[i].len)
+      return e[i].start + bn;
+    bn -= e[i].len;
+  }
+
+  b = ip->addrs[EXTROOT];
+  while(b){
+    if(peek)
+      bp = bpeek(ip->dev, b);
+    else
+      bp = bread(ip->dev, b);
+    if(bp == 0)
+      return 0;
+    eb = (struct extblock*)bp->data;
+    for(i = 0; i < eb->n && bn >= eb->e[i].len; i++)
+      bn -= eb->e[i].len;
+    leaf = eb->depth == 0;
+    if(i == eb->n)
+      b = 0;
+    else if(leaf)
+      b = eb->e[i].start + bn;
+    else
+      b = eb->e[i].start;
+    brelse(bp);
+    if(leaf)
+      break;
+  }
+  return b;
+}
+
+// Add block b to the end of ip's extent tree, creating the
+// tree if need be.
+static void
+etree_add(struct inode *ip, uint b)
+{
+  struct buf *bp[EXTDEPTH+1], *nbp;
+  struct extblock *eb, *neb;
+  uint nb, child;
+  int k, d, i;
+
+  // tree blocks go wherever there is room, not in the way
+  // of the file's next block.
+  if(ip->addrs[EXTROOT] == 0)
+    ip->addrs[EXTROOT] = balloc(ip->dev, 0, 0);  // empty leaf
+
+again:
+  // the path to the last leaf.
+  bp[0] = bread(ip->dev, ip->addrs[EXTROOT]);
+  for(k = 0; (eb = (struct extblock*)bp[k]->data)->depth > 0; k++)
+    bp[k+1] = bread(ip->dev, eb->e[eb->n-1].start);
+
+  if(eb->n > 0 && eb->e[eb->n-1].start + eb->e[eb->n-1].len == b){
+    eb->e[eb->n-1].len++;
+    d = k;
+  } else if(eb->n < EPB){
+    eb->e[eb->n].start = b;
+    eb->e[eb->n].len = 1;
+    eb->n++;
+    d = k;
+  } else {
+    // the leaf is full; hang a new one off the lowest
+    // block on the path with room.
+    for(d = k - 1; d >= 0; d--)
+      if(((struct extblock*)bp[d]->data)->n < EPB)
+        break;
+    if(d < 0){
+      // none: push the root's entries down a level, so
+      // that the root stays where the inode says.
+      eb = (struct extblock*)bp[0]->data;
+      if(eb->depth >= EXTDEPTH)
+        panic("etree_add: too deep");
+      nb = balloc(ip->dev, 0, 0);
+      nbp = bread(ip->dev, nb);
+      memmove(nbp->data, bp[0]->data, BSIZE);
+      log_write(nbp);
+      brelse(nbp);
+      child = 0;
+      for(i = 0; i < eb->n; i++)
+        child += eb->e[i].len;
+      eb->e[0].start = nb;
+      eb->e[0].len = child;
+      eb->n = 1;
+      eb->depth++;
+      log_write(bp[0]);
+      for(i = 0; i <= k; i++)
+        brelse(bp[i]);
+      goto again;
+    }
+    // a chain of new blocks from depth d+1 down to the leaf.
+    child = b;
+    for(i = k; i > d; i--){
+      nb = balloc(ip->dev, 0, 0);
+      nbp = bread(ip->dev, nb);
+      neb = (struct extblock*)nbp->data;
+      neb->n = 1;
+      neb->depth = k - i;
+      neb->e[0].start = child;
+      neb->e[0].len = 1;
+      log_write(nbp);
+      brelse(nbp);
+      child = nb;
+    }
+    eb = (struct extblock*)bp[d]->data;
+    eb->e[eb->n].start = child;
+    eb->e[eb->n].len = 1;
+    eb->n++;
+  }
+  log_write(bp[d]);
+
+  // the blocks above d map one more block.
+  for(i = 0; i < d; i++){
+    eb = (struct extblock*)bp[i]->data;
+    eb->e[eb->n-1].len++;
+    log_write(bp[i]);
+  }
+  for(i = 0; i <= k; i++)
+    brelse(bp[i]);
+}
+
+// Return the disk block holding block bn of extent-mapped ip,
+// allocating it if bn is just past the end of the file.  The
+// goal is the block right after the file's last one, so that
+// the last extent grows.
+static uint
+emap(struct inode *ip, uint bn)
+{
+  struct extent *e = (struct extent*)ip->addrs;
+  struct buf *bp;
+  struct extblock *eb;
+  uint addr, goal;
+  int i, data;
+
+  if((addr = elookup(ip, bn, 0)) != 0)
+    return addr;
+
+  // the end of the last extent.
+  for(i = 0; i < NEXTENT && e[i].len; i++)
+    ;
+  goal = i > 0 ? e[i-1].start + e[i-1].len : 0;
+  if(ip->addrs[EXTROOT]){
+    bp = bread(ip->dev, ip->addrs[EXTROOT]);
+    eb = (struct extblock*)bp->data;
+    while(eb->depth > 0){
+      addr = eb->e[eb->n-1].start;
+      brelse(bp);
+      bp = bread(ip->dev, addr);
+      eb = (struct extblock*)bp->data;
+    }
+    if(eb->n > 0)
+      goal = eb->e[eb->n-1].start + eb->e[eb->n-1].len;
+    brelse(bp);
+  }
+
+  data = ip->type == T_FILE;
+  if(goal == 0)
+    goal = bgoal(ip);
+  addr = balloc(ip->dev, data, goal);
+  ip->lastb = addr;
+
+  if(ip->addrs[EXTROOT] == 0){
+    if(i > 0 && addr == goal){
+      e[i-1].len++;
+      return addr;
+    }
+    if(i < NEXTENT){
+      e[i].start = addr;
+      e[i].len = 1;
+      return addr;
+    }
+  }
+  etree_add(ip, addr);
+  return addr;
+}
+
+// Free the blocks extent tree block b maps, its blocks
+// below, and b.
+static void
+etree_free(uint dev, uint b)
+{
+  struct buf *bp;
+  struct extblock *eb;
+  uint j;
+  int i;
+
+  bp = bread(dev, b);
+  eb = (struct extblock*)bp->data;
+  for(i = 0; i < eb->n; i++){
+    if(eb->depth > 0)
+      etree_free(dev, eb->e[i].start);
+    else
+      for(j = 0; j < eb->e[i].len; j++)
+        bfree(dev, eb->e[i].start + j);
+  }
+  brelse(bp);
+  bfree(dev, b);
+}
+
+// Free all of extent-mapped ip's blocks.
+static void
+etrunc(struct inode *ip)
+{
+  struct extent *e = (struct extent*)ip->addrs;
+  uint j;
+  int i;
+
+  for(i = 0; i < NEXTENT; i++)
+    for(j = 0; j < e[i].len; j++)
+      bfree(ip->dev, e[i].start + j);
+  if(ip->addrs[EXTROOT])
+    etree_free(ip->dev, ip->addrs[EXTROOT]);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+}
+
+static uint bmap_ra(struct inode*, uint);
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -388,9 +1022,18 @@ bmap(struct inode *ip, uint bn)
   uint addr, *a;
   struct buf *bp;
 
+  if(ip->flags & DI_EXTENT)
+    return emap(ip, bn);
+
+  // lastb is not kept on disk; if ip was evicted and is
+  // growing now, go on from its last block.  (Not later: the
+  // indirect blocks below are locked while bnew() runs.)
+  if(ip->lastb == 0 && ip->size > 0 && bn >= ip->size / BSIZE)
+    ip->lastb = bmap_ra(ip, (ip->size - 1) / BSIZE);
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = bnew(ip, ip->type == T_FILE);
     return addr;
   }
   bn -= NDIRECT;
@@ -399,11 +1042,11 @@ bmap(struct inode *ip, uint bn)
     if(bn < SINGLEINDIRECT){
       // Load single indirect block, allocating if necessary.
       if((addr = ip->addrs[NDIRECT]) == 0)
-        ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+        ip->addrs[NDIRECT] = addr = bnew(ip, 0);
       bp = bread(ip->dev, addr);
       a = (uint*)bp->data;
       if((addr = a[bn]) == 0){
-        a[bn] = addr = balloc(ip->dev);
+        a[bn] = addr = bnew(ip, ip->type == T_FILE);
         log_write(bp);
       }
       brelse(bp);
@@ -413,13 +1056,13 @@ bmap(struct inode *ip, uint bn)
       bn -= SINGLEINDIRECT;
       // Load double indirect block, allocating if necessary.
       if((addr = ip->addrs[NDIRECT + 1 + bn / DOUBLEINDIRECT]) == 0)
-        ip->addrs[NDIRECT + 1 + bn / DOUBLEINDIRECT] = addr = balloc(ip->dev);
+        ip->addrs[NDIRECT + 1 + bn / DOUBLEINDIRECT] = addr = bnew(ip, 0);
       bp = bread(ip->dev, addr);
       a = (uint*)bp->data;
 
       int first_indirect_bn = (bn % DOUBLEINDIRECT) / SINGLEINDIRECT;
       if((addr = a[first_indirect_bn]) == 0){
-        a[first_indirect_bn] = addr = balloc(ip->dev);
+        a[first_indirect_bn] = addr = bnew(ip, 0);
         log_write(bp);
       }
       brelse(bp);
@@ -430,7 +1073,7 @@ bmap(struct inode *ip, uint bn)
 
       int second_indirect_bn = bn % SINGLEINDIRECT;
       if((addr = a[second_indirect_bn]) == 0){
-        a[second_indirect_bn] = addr = balloc(ip->dev);
+        a[second_indirect_bn] = addr = bnew(ip, ip->type == T_FILE);
         log_write(bp);
       }
       brelse(bp);
@@ -441,6 +1084,87 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Like bmap(), but for readahead: never allocates, and
+// never waits for the disk.  Returns 0 if block bn is not
+// mapped, or if mapping it needs an indirect block that is
+// not cached yet, in which case bpeek() starts reading it.
+static uint
+bmap_ra(struct inode *ip, uint bn)
+{
+  uint addr, idx;
+  struct buf *bp;
+
+  if(ip->flags & DI_EXTENT)
+    return elookup(ip, bn, 1);
+
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if(bn < SINGLEINDIRECT){
+    addr = ip->addrs[NDIRECT];
+    idx = bn;
+  } else if(bn < NINDIRECT){
+    bn -= SINGLEINDIRECT;
+    if((addr = ip->addrs[NDIRECT + 1 + bn / DOUBLEINDIRECT]) == 0)
+      return 0;
+    if((bp = bpeek(ip->dev, addr)) == 0)
+      return 0;
+    addr = ((uint*)bp->data)[(bn % DOUBLEINDIRECT) / SINGLEINDIRECT];
+    brelse(bp);
+    idx = bn % SINGLEINDIRECT;
+  } else {
+    return 0;
+  }
+
+  if(addr == 0 || (bp = bpeek(ip->dev, addr)) == 0)
+    return 0;
+  addr = ((uint*)bp->data)[idx];
+  brelse(bp);
+  return addr;
+}
+
+// Sequential readahead.  A read of blocks bn..last that
+// starts where the previous read of ip ended (or in the
+// same block) is sequential: the window of blocks to read
+// ahead doubles, up to RA_MAX.  Any other read collapses
+// it.  Starts asynchronous reads of the blocks in the
+// window that have not been started yet, one disk request
+// per run of contiguous blocks.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn, uint last)
+{
+  uint b, end, addr, start = 0;
+  int n = 0;
+
+  if(bn == ip->ra_next || bn + 1 == ip->ra_next){
+    ip->ra_win = ip->ra_win ? min(2 * ip->ra_win, RA_MAX) : RA_MIN;
+  } else {
+    ip->ra_win = 0;
+    ip->ra_end = 0;
+  }
+  ip->ra_next = last + 1;
+  if(ip->ra_win == 0)
+    return;
+
+  end = min(last + 1 + ip->ra_win, (ip->size + BSIZE - 1) / BSIZE);
+  for(b = max(ip->ra_end, last + 1); b < end; b++){
+    if((addr = bmap_ra(ip, b)) == 0)
+      break;
+    if(n > 0 && addr != start + n){
+      bprefetch_range(ip->dev, start, n);
+      n = 0;
+    }
+    if(n == 0)
+      start = addr;
+    n++;
+  }
+  if(n > 0)
+    bprefetch_range(ip->dev, start, n);
+  ip->ra_end = b;
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -453,6 +1177,15 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  ip->lastb = 0;
+  if(ip->flags & DI_EXTENT){
+    etrunc(ip);
+    ip->size = 0;
+    ip->dseq = log_seq();
+    iupdate(ip);
+    return;
+  }
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -496,6 +1229,7 @@ itrunc(struct inode *ip)
     }
 
   ip->size = 0;
+  ip->dseq = log_seq();
   iupdate(ip);
 }
 
@@ -525,6 +1259,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0)
+    readahead(ip, off/BSIZE, (off + n - 1)/BSIZE);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -564,7 +1300,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(ip->type == T_FILE)
+      log_data(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -574,6 +1313,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
   // block to ip->addrs[].
+  ip->dseq = log_seq();
   iupdate(ip);
 
   return tot;
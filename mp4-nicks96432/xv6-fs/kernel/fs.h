@@ -20,10 +20,15 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // FS_* options, fixed by mkfs
 };
 
 #define FSMAGIC 0x10203040
 
+#define FS_DISCARD 0x1  // discard freed blocks after each commit
+#define FS_ORDERED 0x2  // log only metadata; write file data in place
+#define FS_EXTENT  0x4  // new files and directories map blocks by extent
+
 // TODO: bigfile. You may need to modify these.
 // size of double indirect is single indirect * (BSIZE / sizeof(uint))
 
@@ -38,13 +43,41 @@ struct superblock {
 
 struct dinode {
   short type;                           // File type
-  short major;                          // Major device number (T_DEVICE only)
+  uchar major;                          // Major device number (T_DEVICE only)
+  uchar flags;                          // DI_* (once the high byte of major)
   short minor;                          // Minor device number (T_DEVICE only)
   short nlink;                          // Number of links to inode in file system
   uint size;                            // Size of file (bytes)
   uint addrs[NDIRECT+1+NDOUBLEINDIRECT];// Data block addresses
 };
 
+#define DI_EXTENT 0x1  // addrs[] holds extents, not block addresses
+
+// With DI_EXTENT, addrs[] holds NEXTENT extents, in file order,
+// then the block # of the root of an extent tree for the rest,
+// or 0.  Unused extents have len 0.
+struct extent {
+  uint start;  // first disk block
+  uint len;    // number of blocks
+};
+
+#define NEXTENT 6
+#define EXTROOT (2*NEXTENT)  // addrs[] index of the tree root
+
+// Extents per tree block
+#define EPB ((BSIZE - 2*sizeof(uint)) / sizeof(struct extent))
+
+#define EXTDEPTH 3  // max depth of an extent tree
+
+// A block of the extent tree.  In a leaf (depth 0), e[] are
+// extents.  Above that, e[i].start is a child block and
+// e[i].len the number of file blocks the child maps.
+struct extblock {
+  uint n;      // entries in use
+  uint depth;
+  struct extent e[EPB];
+};
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -57,6 +90,14 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
+// Allocation groups: the blocks of GROUPBMAP bitmap blocks.
+// The allocator keeps a directory's files in its group.
+#define GROUPBMAP     1
+#define BPG           (BPB*GROUPBMAP)  // blocks per group
+
+// Allocation group containing block b
+#define BGROUP(b)     ((b)/BPG)
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
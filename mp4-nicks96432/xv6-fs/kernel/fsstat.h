@@ -0,0 +1,12 @@
+// Block allocator statistics, filled in by the fsstat() system call.
+// Both the kernel and user programs use this header file.
+
+#define FSSTAT_RESET  1   // fsstat() flag: zero the counters afterwards
+
+struct fsstat {
+  uint size;         // Blocks in the file system
+  uint nfree;        // Free blocks
+  uint64 allocs;     // Blocks balloc() has allocated
+  uint64 alloctime;  // Timer cycles balloc() spent finding them
+  uint64 bmscans;    // Bitmap blocks balloc() has searched
+};
@@ -0,0 +1,303 @@
+// Disk request scheduler.
+//
+// Sits between the buffer cache and the virtio disk driver.
+// The driver gets at most IOS_DEPTH requests at a time; the
+// rest wait here in a queue sorted by block number.  A block
+// that is adjacent to a queued request of the same kind is
+// merged into it, so that one virtio request can move up to
+// MAXSEG blocks, e.g. when itrunc() frees a run of blocks or
+// install_trans() writes a transaction home.
+//
+// The queue is served in one direction (C-SCAN): the next
+// request is the first one at or after the block where the
+// previous one ended, wrapping around to the lowest block.
+// So that a stream of writes cannot starve readers, each
+// request has a deadline, much shorter for reads than for
+// writes.  Once requests have waited past their deadline,
+// the oldest of them goes next.
+//
+// With a multi-queue disk, each virtqueue has its own
+// scheduler queue and lock, and a hart submits to the queue
+// cpuid() % nqueue, so that harts doing I/O at the same time
+// do not contend.
+//
+// A request is represented by its first buf; the others are
+// linked through b->qnext.  q->lock protects the queue and
+// the request fields of queued bufs.  It is acquired before
+// the driver's lock for the same queue.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+
+// Requests the driver may have in flight before new
+// ones queue up here to be sorted and merged.
+#define IOS_DEPTH 8
+
+// Timer cycles (10 MHz on qemu) a request may wait
+// before it is served out of order.
+#define READ_EXPIRE  500000   // 50 ms
+#define WRITE_EXPIRE 5000000  // 500 ms
+
+struct iosq {
+  struct spinlock lock;
+  struct buf *queue; // pending requests, sorted, through rqnext
+  int inflight;      // requests the driver is working on
+  uint pos;          // block after the last request dispatched
+};
+
+struct iosq ios[NCPU];
+int nios;            // one per virtqueue
+
+void
+iosched_init(void)
+{
+  nios = virtio_disk_nqueue();
+  for(int i = 0; i < nios; i++)
+    initlock(&ios[i].lock, "iosched");
+}
+
+// Does request r come after block b in the queue?
+static int
+ios_after(struct buf *r, struct buf *b)
+{
+  if(r->dev != b->dev)
+    return r->dev > b->dev;
+  return r->blockno > b->blockno;
+}
+
+// Try to merge request b into the request *rp, at either end.
+// Returns 1 if b is now part of the request.
+// Caller holds q->lock.
+static int
+ios_merge(struct buf **rp, struct buf *b)
+{
+  struct buf *r = *rp, *n;
+  int maxseg = virtio_disk_maxseg();
+
+  if(r->dev != b->dev || r->qwrite != b->qwrite || r->nseg + b->nseg > maxseg)
+    return 0;
+
+  if(r->qtail->blockno + 1 == b->blockno){
+    r->qtail->qnext = b;
+    r->qtail = b->qtail;
+    r->nseg += b->nseg;
+    if(b->deadline < r->deadline)
+      r->deadline = b->deadline;
+    // b may have filled the gap to the next request.
+    n = r->rqnext;
+    if(n && n->dev == r->dev && n->qwrite == r->qwrite &&
+       r->qtail->blockno + 1 == n->blockno && r->nseg + n->nseg <= maxseg){
+      r->qtail->qnext = n;
+      r->qtail = n->qtail;
+      r->nseg += n->nseg;
+      if(n->deadline < r->deadline)
+        r->deadline = n->deadline;
+      r->rqnext = n->rqnext;
+    }
+    return 1;
+  }
+
+  if(b->qtail->blockno + 1 == r->blockno){
+    // b becomes the request's first buf.
+    b->qtail->qnext = r;
+    b->qtail = r->qtail;
+    b->nseg += r->nseg;
+    if(r->deadline < b->deadline)
+      b->deadline = r->deadline;
+    b->rqnext = r->rqnext;
+    *rp = b;
+    return 1;
+  }
+
+  return 0;
+}
+
+// Choose the next request to dispatch and return the
+// link that points to it.
+// Caller holds q->lock; the queue is not empty.
+static struct buf**
+ios_pick(struct iosq *q)
+{
+  struct buf **rp, **oldest = 0, **next = 0;
+  uint64 now = r_time();
+
+  for(rp = &q->queue; *rp; rp = &(*rp)->rqnext){
+    if((*rp)->deadline <= now &&
+       (oldest == 0 || (*rp)->deadline < (*oldest)->deadline))
+      oldest = rp;
+    if(next == 0 && (*rp)->blockno >= q->pos)
+      next = rp;
+  }
+  if(oldest)
+    return oldest;
+  if(next)
+    return next;
+  return &q->queue;
+}
+
+// Hand queued requests to the driver while it has room.
+// Caller holds q->lock.
+static void
+ios_dispatch(struct iosq *q)
+{
+  struct buf **rp, *r;
+  int n = 0;
+
+  while(q->inflight < IOS_DEPTH && q->queue != 0){
+    rp = ios_pick(q);
+    r = *rp;
+    // once started, r may complete and be reused at any time,
+    // so unlink it first.
+    *rp = r->rqnext;
+    if(virtio_disk_start(q - ios, r, r->qwrite, r->nseg) < 0){
+      *rp = r;
+      break;
+    }
+    q->inflight++;
+    q->pos = r->blockno + 1;
+    n++;
+  }
+
+  // one notification for the whole batch.
+  if(n > 0)
+    virtio_disk_notify(q - ios);
+}
+
+// Add request b to the queue, merging it with a queued
+// request if they are adjacent.
+// Caller holds q->lock.
+static void
+ios_enqueue(struct iosq *q, struct buf *b)
+{
+  struct buf **rp;
+
+  for(rp = &q->queue; *rp; rp = &(*rp)->rqnext){
+    if(ios_merge(rp, b))
+      return;
+    if(ios_after(*rp, b))
+      break;
+  }
+  b->rqnext = *rp;
+  *rp = b;
+}
+
+// Queue reads or writes of the n locked bufs in bufs[] and
+// return without waiting.  Bufs with consecutive block
+// numbers go to the disk as one request, so a caller that
+// has a range of blocks to move should submit them together.
+// See virtio_disk_start() for how completion is reported.
+void
+iosched_submitv(struct buf **bufs, int n, int write)
+{
+  struct buf *b, *s;
+  struct iosq *q;
+  uint64 deadline;
+  int i, maxseg;
+
+  deadline = r_time() + (write ? WRITE_EXPIRE : READ_EXPIRE);
+  maxseg = virtio_disk_maxseg();
+
+  // the hart may change before we are done; that is fine,
+  // the choice of queue only spreads the load.
+  push_off();
+  q = &ios[cpuid() % nios];
+  pop_off();
+
+  acquire(&q->lock);
+
+  for(i = 0; i < n; ){
+    b = bufs[i++];
+    b->disk = 1;
+    b->qid = q - ios;
+    b->qwrite = write;
+    b->qtail = b;
+    b->nseg = 1;
+    b->deadline = deadline;
+    while(i < n && b->nseg < maxseg && bufs[i]->dev == b->dev &&
+          bufs[i]->blockno == b->qtail->blockno + 1){
+      s = bufs[i++];
+      s->disk = 1;
+      s->qid = q - ios;
+      s->qwrite = write;
+      b->qtail->qnext = s;
+      b->qtail = s;
+      b->nseg++;
+    }
+    b->qtail->qnext = 0;
+    ios_enqueue(q, b);
+  }
+
+  // dispatch only now, so that a whole range is
+  // in the queue as one request.
+  ios_dispatch(q);
+  release(&q->lock);
+}
+
+// Queue a read or write of locked buf b and return
+// without waiting.
+void
+iosched_submit(struct buf *b, int write)
+{
+  iosched_submitv(&b, 1, write);
+}
+
+// Wait for the request submitted for b to complete.
+void
+iosched_wait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
+// Read or write b and wait for it.
+void
+iosched_rw(struct buf *b, int write)
+{
+  iosched_submit(b, write);
+  iosched_wait(b);
+}
+
+// Make the writes that have completed durable, even if
+// the disk caches them.  Writes still queued or in flight
+// are not covered.
+void
+iosched_flush(uint dev)
+{
+  int q;
+
+  push_off();
+  q = cpuid() % nios;
+  pop_off();
+  virtio_disk_flush(q);
+}
+
+// Tell the disk that n blocks from blockno are free.
+// Nothing in the queue may write them.
+void
+iosched_discard(uint dev, uint blockno, uint n)
+{
+  int q;
+
+  push_off();
+  q = cpuid() % nios;
+  pop_off();
+  virtio_disk_discard(q, blockno, n);
+}
+
+// Called by the driver when n requests on queue qid
+// have completed.
+void
+iosched_done(int qid, int n)
+{
+  struct iosq *q = &ios[qid];
+
+  acquire(&q->lock);
+  q->inflight -= n;
+  ios_dispatch(q);
+  release(&q->lock);
+}
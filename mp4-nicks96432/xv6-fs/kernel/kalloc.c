@@ -21,8 +21,12 @@ struct run {
 struct {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;  // number of pages on freelist
 } kmem;
 
+// Pages to ask the buffer cache for when memory runs out.
+#define SHRINKPAGES 16
+
 void
 kinit()
 {
@@ -59,24 +63,41 @@ kfree(void *pa)
   acquire(&kmem.lock);
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   release(&kmem.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// If memory has run out, reclaims pages from
+// the buffer cache before giving up.
 void *
 kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  for(;;){
+    acquire(&kmem.lock);
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+    }
+    release(&kmem.lock);
+    if(r || bshrink(SHRINKPAGES) == 0)
+      break;
+  }
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Return the number of free pages.
+// Only a hint, since it may change at any time.
+int
+kfreepages(void)
+{
+  return kmem.nfree;
+}
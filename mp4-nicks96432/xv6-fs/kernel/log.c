@@ -17,189 +17,726 @@
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
+// the count of in-progress FS system calls, reserves
+// MAXOPBLOCKS of log space, and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// asks for a commit and sleeps until it is done.  A system
+// call that writes more, like a large write(), reserves
+// what it needs with begin_opn()/end_opn() instead, up to
+// log_opmax() blocks.
+//
+// Commits are done by a kernel thread, log_thread(), so that
+// end_op() returns as soon as the system call's updates are in
+// the transaction.  The thread commits once no FS system calls
+// are active and either the transaction has been open for
+// COMMITTICKS, or someone asked: begin_op() when the log is
+// full, or log_wait() on behalf of fsync().  Each transaction
+// has a number, and the inode layer records the last one that
+// changed each inode, so that fsync() waits only for that one.
+//
+// There are two in-memory transactions: the open one, which FS
+// system calls add to, and the one being committed.  Closing a
+// transaction copies its blocks into the log blocks in the
+// cache, with no system calls active; after that, new system
+// calls proceed in a fresh open transaction while the closed
+// one is written.  The open transaction may change a cached
+// block that the committing one has yet to install; such a
+// block is installed from the copy in the log, and the cached
+// block is left as it was.  The on-disk log holds at most one
+// transaction, so the next commit waits for the previous one.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+//   header blocks, containing n, seq, sum, and block #s for
+//     block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// mkfs chooses the size of the log, sb.nlog; as many header
+// blocks as needed for the rest to be listed come first.
+// sum is a checksum of seq, the block #s, and the contents of
+// the log blocks, so a header is only believed if the blocks
+// it describes all reached the disk.  That lets commit() write
+// the header and the log blocks together, as one run of disk
+// requests, and a single flush after them is the commit point.
+// The home locations are moved LOGBATCH at a time, with requests
+// the disk scheduler sorts and merges; see install_trans().
+//
+// The header is not erased after the install.  Installing a
+// committed transaction again is harmless, so recover_from_log()
+// replays whatever the log holds if its checksum is good; only
+// an FS_ORDERED transaction of data alone, which may overwrite
+// a block the log holds, writes an empty header to retire it.
+// What must not happen is the next commit overwriting the log
+// before the home locations it would replay are durable;
+// rather than flushing after every install, the next commit
+// that writes the log flushes first, if nothing else has since.
+//
+// With FS_DISCARD, blocks freed by a transaction are collected
+// as ranges and discarded once it has committed; a block that
+// is allocated again before then is taken back out.
+//
+// With FS_ORDERED, only metadata goes through the log.  The
+// inode layer hands file data blocks to log_data() instead, and
+// a transaction keeps them in a second list; closing it starts
+// writing them to their home locations, and commit() waits for
+// them before the log blocks, so that no committed inode or
+// indirect block can point at a block whose contents never
+// reached the disk.  Nor may a freed block be written for
+// another file until the freeing transaction has committed, so
+// bfree() holds it back until then.  A block that is logged as
+// metadata in the same transaction as it is written as data is
+// written both ways; the log copy is installed later and wins.
+
+#define NDISCARD 64  // max ranges of freed blocks per transaction
+
+#define LOGBATCH 16  // max log blocks moved at once
 
-// Contents of the header block, used for both the on-disk header block
+#define LPB (BSIZE / sizeof(int))  // header entries per block
+#define LOGHDR 3  // n, seq, and sum come before the block #s
+
+#define LOGHASH 1024  // buckets for finding a block in a transaction
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Contents of the header blocks, used for both the on-disk header
 // and to keep track in memory of logged block# before commit.
+// On disk, seq and sum follow n; see write_log().
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
+};
+
+// An in-memory transaction.
+struct trans {
+  struct logheader lh;
+  uint seq;        // transaction number
+  uint opened;     // ticks when the first block was logged.
+  // lh.block[] hashed by block #, chained through next[].
+  int head[LOGHASH];
+  int next[LOGMAX];
+  // file data blocks, for FS_ORDERED, hashed the same way.
+  uint data[LOGMAX];
+  int ndata;
+  int dhead[LOGHASH];
+  int dnext[LOGMAX];
+  int ndiscard;
+  struct {
+    uint start;
+    uint n;
+  } dlist[NDISCARD]; // blocks this transaction freed
+  int resv;        // cache buffers breserve() promised it
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int nhead;       // header blocks at start
+  int cap;         // max blocks in a transaction
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they may still write.
+  int closing;     // copying cur's blocks to the log, please wait.
+  int committing;  // com is being committed.
+  int force;       // commit cur as soon as possible.
+  uint done;       // number of the last committed transaction.
+  int installed;   // home writes since the last flush?
+  int live;        // does the log on disk hold a transaction?
   int dev;
-  struct logheader lh;
+  int discard;     // discard freed blocks?
+  int ordered;     // log only metadata?
+  struct trans *cur; // the open transaction
+  struct trans *com; // the one being committed
+  struct trans trans[2];
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void trans_init(struct trans*);
+static void snapshot(struct trans*, struct buf**);
+static void write_data(struct trans*, struct buf**);
+static void commit(struct trans*, struct buf**, struct buf**);
+static void log_thread(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
-
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  // n, seq, sum, and the block #s, one per remaining log block.
+  log.nhead = (log.size + LOGHDR + LPB) / (LPB + 1);
+  log.cap = min(log.size - log.nhead, LOGMAX);
+  if (log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  log.discard = (sb->flags & FS_DISCARD) != 0;
+  log.ordered = (sb->flags & FS_ORDERED) != 0;
+  log.cur = &log.trans[0];
+  log.com = &log.trans[1];
+  log.cur->seq = 1;
+  trans_init(log.cur);
+  trans_init(log.com);
   recover_from_log();
+  kthread(log_thread, "log");
 }
 
-// Copy committed blocks from log to their home location
+// Empty transaction t.
 static void
-install_trans(int recovering)
+trans_init(struct trans *t)
 {
-  int tail;
+  int i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  t->lh.n = 0;
+  t->ndata = 0;
+  t->ndiscard = 0;
+  for (i = 0; i < LOGHASH; i++) {
+    t->head[i] = -1;
+    t->dhead[i] = -1;
   }
 }
 
-// Read the log header from disk into the in-memory log header
-static void
-read_head(void)
+// Is transaction t empty?
+static int
+trans_empty(struct trans *t)
+{
+  return t->lh.n == 0 && t->ndata == 0;
+}
+
+// Find block b in transaction t; return its index or -1.
+// Caller holds log.lock.
+static int
+trans_find(struct trans *t, uint b)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
-  brelse(buf);
+
+  for (i = t->head[b % LOGHASH]; i >= 0; i = t->next[i])
+    if (t->lh.block[i] == b)
+      break;
+  return i;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Find data block b in transaction t; return its index or -1.
+// Caller holds log.lock.
+static int
+data_find(struct trans *t, uint b)
+{
+  int i;
+
+  for (i = t->dhead[b % LOGHASH]; i >= 0; i = t->dnext[i])
+    if (t->data[i] == b)
+      break;
+  return i;
+}
+
+// Is block b in the open transaction?
+static int
+in_cur(uint b)
+{
+  int r;
+
+  acquire(&log.lock);
+  r = trans_find(log.cur, b) >= 0 || data_find(log.cur, b) >= 0;
+  release(&log.lock);
+  return r;
+}
+
+// Copy log block lb into its locked home block db, first
+// saving db's contents in saved if the open transaction has
+// changed it.  holding db's lock, so the open transaction
+// cannot change it or add it meanwhile.
 static void
-write_head(void)
+install_copy(struct buf *db, struct buf *lb, uchar *saved, int *busy)
+{
+  *busy = in_cur(db->blockno);
+  if (*busy)
+    memmove(saved, db->data, BSIZE);
+  memmove(db->data, lb->data, BSIZE);  // copy block to dst
+}
+
+// db has been written home; give the open transaction its
+// copy back, and release db.
+static void
+install_done(struct buf *db, uchar *saved, int busy, int recovering)
+{
+  if (busy)
+    memmove(db->data, saved, BSIZE);
+  if(recovering == 0)
+    bunpin(db);
+  brelse(db);
+}
+
+// Copy committed blocks from log to their home location
+static void
+install_trans(struct trans *t, int recovering)
+{
+  // cached blocks the open transaction has changed, while
+  // their committed contents are written home.  only the
+  // log thread installs, so one copy will do.
+  static uchar saved[LOGBATCH][BSIZE];
+  struct buf *lbuf[LOGBATCH], *dbuf[LOGBATCH], *w[LOGBATCH];
+  int tail, i, n, nw, busy[LOGBATCH];
+
+  // during recovery nothing is cached; start reading the
+  // whole log at once.
+  if(recovering)
+    bprefetch_range(log.dev, log.start+log.nhead, t->lh.n);
+
+  for (tail = 0; tail < t->lh.n; tail += n) {
+    n = min(t->lh.n - tail, LOGBATCH);
+    bread_range(log.dev, log.start+log.nhead+tail, n, lbuf); // read log blocks
+    // the open transaction may hold a home block, say an
+    // indirect block, while it waits for another, say a
+    // bitmap block, in balloc(); so don't wait for one while
+    // holding others.  take the ones no one holds as a batch.
+    nw = 0;
+    for (i = 0; i < n; i++) {
+      if (recovering)
+        dbuf[i] = bread(log.dev, t->lh.block[tail+i]); // read dst
+      else
+        dbuf[i] = btryget(log.dev, t->lh.block[tail+i]); // pinned
+      if (dbuf[i] == 0)
+        continue;
+      w[nw++] = dbuf[i];
+      install_copy(dbuf[i], lbuf[i], saved[i], &busy[i]);
+    }
+    if (nw > 0)
+      bwritev(w, nw);  // write dst to disk
+    for (i = 0; i < n; i++) {
+      if (dbuf[i])
+        install_done(dbuf[i], saved[i], busy[i], recovering);
+    }
+    // then the busy ones, one at a time.
+    for (i = 0; i < n; i++) {
+      if (dbuf[i] == 0) {
+        dbuf[i] = bread(log.dev, t->lh.block[tail+i]);
+        install_copy(dbuf[i], lbuf[i], saved[i], &busy[i]);
+        bwrite(dbuf[i]);
+        install_done(dbuf[i], saved[i], busy[i], recovering);
+      }
+      brelse(lbuf[i]);
+    }
+  }
+}
+
+// Fold the nw words at w into checksum h (FNV-1a, a word
+// at a time).
+static uint
+cksum(uint h, uint *w, int nw)
+{
+  int i;
+
+  for (i = 0; i < nw; i++)
+    h = (h ^ w[i]) * 16777619;
+  return h;
+}
+
+// The checksum of t's header, before its log blocks are
+// folded in with sum_blocks().
+static uint
+sum_head(struct trans *t)
+{
+  uint h;
+
+  h = cksum(2166136261, &t->seq, 1);
+  return cksum(h, (uint *) t->lh.block, t->lh.n);
+}
+
+// Fold the n log blocks in lb[] into checksum h.
+static uint
+sum_blocks(uint h, struct buf **lb, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    h = cksum(h, (uint *) lb[i]->data, BSIZE / sizeof(uint));
+  return h;
+}
+
+// Read the log header from disk into the in-memory log header,
+// and return the checksum it records.  A header whose count is
+// out of range, torn or never written, holds no transaction.
+static uint
+read_head(struct trans *t)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  int *hb = (int *) (buf->data);
+  uint sum;
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  t->lh.n = hb[0];
+  t->seq = hb[1];
+  sum = hb[2];
+  if (t->lh.n < 0 || t->lh.n > log.cap) {
+    t->lh.n = 0;
+    brelse(buf);
+    return sum;
+  }
+  for (i = 0; i < t->lh.n; i++) {
+    // entry i+LOGHDR of the header.
+    if ((i+LOGHDR) % LPB == 0) {
+      brelse(buf);
+      buf = bread(log.dev, log.start + (i+LOGHDR) / LPB);
+      hb = (int *) (buf->data);
+    }
+    t->lh.block[i] = hb[(i+LOGHDR) % LPB];
   }
-  bwrite(buf);
   brelse(buf);
+  return sum;
+}
+
+// Do t's log blocks on disk match checksum sum?
+// Reads them LOGBATCH at a time, so as not to need a
+// cache as big as the log.
+static int
+log_valid(struct trans *t, uint sum)
+{
+  struct buf *lb[LOGBATCH];
+  int tail, i, n;
+  uint h;
+
+  if (t->lh.n == 0)
+    return 1;
+  h = sum_head(t);
+  for (tail = 0; tail < t->lh.n; tail += n) {
+    n = min(t->lh.n - tail, LOGBATCH);
+    bread_range(log.dev, log.start+log.nhead+tail, n, lb);
+    h = sum_blocks(h, lb, n);
+    for (i = 0; i < n; i++)
+      brelse(lb[i]);
+  }
+  return h == sum;
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  uint sum;
+
+  sum = read_head(log.com);
+  // a commit cut short by a crash left a header that does not
+  // match its blocks; it never happened.
+  if (!log_valid(log.com, sum))
+    log.com->lh.n = 0;
+  install_trans(log.com, 1); // if committed, copy from log to disk
+  bflush(log.dev);
+  // carry on numbering after the transaction in the log,
+  // so that its header cannot pass for a later one's.
+  log.done = log.com->seq;
+  log.cur->seq = log.com->seq + 1;
+  log.live = log.com->lh.n > 0;
+}
+
+// the most blocks one FS system call may reserve.  half the
+// log, so that a large write() leaves room for others.
+int
+log_opmax(void)
+{
+  return log.cap / 2 > MAXOPBLOCKS ? log.cap / 2 : MAXOPBLOCKS;
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
 {
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the end of each FS system call.
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// make sure the cache can hold every block the open
+// transaction may pin if an op of n more blocks starts: its
+// metadata blocks, the log blocks snapshot() copies them to,
+// and, for FS_ORDERED, its data blocks.  caller holds log.lock.
+static int
+log_reserve(int n)
+{
+  struct trans *t = log.cur;
+  int r = log.reserved + n;
+  int need;
+
+  need = 2 * (t->lh.n + r) + (log.ordered ? t->ndata + r : 0);
+  if(need <= t->resv)
+    return 1;
+  if(!breserve(need - t->resv))
+    return 0;
+  t->resv = need;
+  return 1;
+}
+
+// start an FS system call that writes at most n blocks.
+void
+begin_opn(int n)
+{
+  if(n > log_opmax())
+    panic("begin_opn");
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing || log.force){
+      // let the transaction drain and close.
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.cur->lh.n + log.reserved + n > log.cap ||
+              log.cur->ndata + log.reserved + n > LOGMAX){
       // this op might exhaust log space; wait for commit.
+      log.force = 1;
+      wakeup(&log.force);
+      sleep(&log, &log.lock);
+    } else if(!log_reserve(n)){
+      // memory is short; wait for a commit to give the
+      // cache buffers back, if one can.
+      if(log.outstanding == 0 && !log.committing &&
+         trans_empty(log.cur))
+        panic("begin_opn: no buffers");
+      log.force = 1;
+      wakeup(&log.force);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// end an FS system call started with begin_opn(n).
+// the log thread commits later; see log_wait().
 void
-end_op(void)
+end_opn(int n)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
+  log.reserved -= n;
+  if(log.closing)
+    panic("log.closing");
   if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+    if(log.force)
+      wakeup(&log.force);
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // and decrementing log.reserved has freed some.
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
+// should the log thread close the open transaction now?
+// caller holds log.lock.
+static int
+commit_due(void)
+{
+  if(log.outstanding > 0)
+    return 0;
+  if(log.force)
+    return 1;
+  return !trans_empty(log.cur) && ticks - log.cur->opened >= COMMITTICKS;
+}
+
+// commit transactions in the background.
+static void
+log_thread(void)
+{
+  // the log blocks and data blocks of the closed transaction.
+  static struct buf *to[LOGMAX];
+  static struct buf *dbuf[LOGMAX];
+  struct trans *t;
+
+  acquire(&log.lock);
+  for(;;){
+    while(!commit_due())
+      sleep(&log.force, &log.lock);
+
+    // close the open transaction, and open the other one.
+    t = log.cur;
+    log.cur = log.com;
+    log.com = t;
+    trans_init(log.cur);
+    log.cur->seq = t->seq + 1;
+    log.closing = 1;
+    log.force = 0;
+    release(&log.lock);
+
+    // no FS system calls are active, and none can start,
+    // so the cached blocks hold just t's updates.
+    // copy them w/o holding locks, since not allowed
     // to sleep with locks.
-    commit();
+    snapshot(t, to);
+    write_data(t, dbuf);
+
     acquire(&log.lock);
-    log.committing = 0;
+    log.closing = 0;
+    log.committing = 1;
     wakeup(&log);
     release(&log.lock);
+
+    commit(t, to, dbuf);
+    bunreserve(t->resv); // its blocks are unpinned
+    t->resv = 0;
+
+    acquire(&log.lock);
+    log.committing = 0;
+    log.done = t->seq;
+    wakeup(&log);
   }
 }
 
-// Copy modified blocks from cache to log.
+// called by the clock interrupt.  wake the log thread if the
+// transaction has been open too long.  the check is racy, but
+// a missed wakeup only delays the commit by a tick.
+void
+log_tick(void)
+{
+  if(log.cur && !trans_empty(log.cur) && ticks - log.cur->opened >= COMMITTICKS)
+    wakeup(&log.force);
+}
+
+// the number of the current transaction, which holds the
+// updates of the caller's FS system call, if it is in one.
+uint
+log_seq(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  seq = log.cur ? log.cur->seq : 0;
+  release(&log.lock);
+  return seq;
+}
+
+// wait until transaction seq is on disk.
+void
+log_wait(uint seq)
+{
+  acquire(&log.lock);
+  // an open transaction with nothing in it needs no commit,
+  // but the one before it may still be committing, and may
+  // hold the caller's changes.
+  if(seq == log.cur->seq && trans_empty(log.cur))
+    seq = log.cur->seq - 1;
+  while(log.done < seq){
+    if(seq == log.cur->seq){
+      log.force = 1;
+      wakeup(&log.force);
+    }
+    sleep(&log, &log.lock);
+  }
+  release(&log.lock);
+}
+
+// Copy modified blocks from cache to log blocks in the cache,
+// and return the log blocks, still locked, in to[].
 static void
-write_log(void)
+snapshot(struct trans *t, struct buf **to)
 {
-  int tail;
+  int tail, i, n;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < t->lh.n; tail += n) {
+    n = min(t->lh.n - tail, LOGBATCH);
+    bread_range(log.dev, log.start+log.nhead+tail, n, to+tail); // log blocks
+    for (i = 0; i < n; i++) {
+      struct buf *from = bread(log.dev, t->lh.block[tail+i]); // cache block
+      memmove(to[tail+i]->data, from->data, BSIZE);
+      brelse(from);
+    }
   }
 }
 
+// Start writing t's data blocks to their home locations, and
+// return them, still locked, in dbuf[].  Sorted, so that the
+// disk scheduler can merge runs of a file into few requests.
 static void
-commit()
+write_data(struct trans *t, struct buf **dbuf)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int i, j;
+  uint b;
+
+  for (i = 1; i < t->ndata; i++) {
+    b = t->data[i];
+    for (j = i; j > 0 && t->data[j-1] > b; j--)
+      t->data[j] = t->data[j-1];
+    t->data[j] = b;
   }
+  for (i = 0; i < t->ndata; i++)
+    dbuf[i] = bread(log.dev, t->data[i]);
+  bwritev_async(dbuf, t->ndata);
+}
+
+// Wait for the writes from write_data(), and let the
+// data blocks go.
+static void
+wait_data(struct trans *t, struct buf **dbuf)
+{
+  int i;
+
+  for (i = 0; i < t->ndata; i++) {
+    bwait(dbuf[i]);
+    bunpin(dbuf[i]);
+    brelse(dbuf[i]);
+  }
+}
+
+// Write the header and the log blocks from snapshot() to disk,
+// all at once.  The transaction has committed once they are
+// durable.
+static void
+write_log(struct trans *t, struct buf **to)
+{
+  static struct buf *w[(LOGMAX + LOGHDR + LPB - 1) / LPB + LOGMAX];
+  int *hb;
+  int i, nb;
+
+  nb = (t->lh.n + LOGHDR + LPB - 1) / LPB;
+  bread_range(log.dev, log.start, nb, w);
+  hb = (int *) (w[0]->data);
+  hb[0] = t->lh.n;
+  hb[1] = t->seq;
+  hb[2] = sum_blocks(sum_head(t), to, t->lh.n);
+  for (i = 0; i < t->lh.n; i++) {
+    hb = (int *) (w[(i+LOGHDR) / LPB]->data);
+    hb[(i+LOGHDR) % LPB] = t->lh.block[i];
+  }
+  for (i = 0; i < t->lh.n; i++)
+    w[nb+i] = to[i];
+  bwritev(w, nb + t->lh.n);
+  for (i = 0; i < nb + t->lh.n; i++)
+    brelse(w[i]);
+}
+
+// Discard the blocks the committed transaction freed.
+static void
+discard_trans(struct trans *t)
+{
+  int i;
+
+  for(i = 0; i < t->ndiscard; i++)
+    bdiscard(log.dev, t->dlist[i].start, t->dlist[i].n);
+  t->ndiscard = 0;
+}
+
+static void
+commit(struct trans *t, struct buf **to, struct buf **dbuf)
+{
+  wait_data(t, dbuf); // Data blocks are home before the metadata
+  // a transaction of data alone may have overwritten a block
+  // the log would replay, so it also writes a header, empty.
+  if (t->lh.n > 0 || (t->ndata > 0 && log.live)) {
+    if (log.installed)
+      bflush(log.dev); // The last install is durable before its log goes
+    write_log(t, to); // Write header and modified blocks to log
+    bflush(log.dev); // The real commit, with the data blocks
+    install_trans(t, 0); // Now install writes to home locations
+    log.installed = log.live = t->lh.n > 0;
+  } else if (t->ndata > 0) {
+    bflush(log.dev); // Data blocks are durable, for fsync()
+    log.installed = 0;
+  }
+  discard_trans(t);
+  bunhold(t - log.trans); // its freed blocks may be reused
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -216,21 +753,135 @@ log_write(struct buf *b)
 {
   int i;
 
+  struct trans *t;
+
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  t = log.cur;
+  if (t->lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
-      break;
+  i = trans_find(t, b->blockno);   // log absorbtion
+  if (i < 0) {  // Add new block to log?
+    i = t->lh.n++;
+    t->lh.block[i] = b->blockno;
+    t->next[i] = t->head[b->blockno % LOGHASH];
+    t->head[b->blockno % LOGHASH] = i;
+    bpin(b);
+    if (i == 0 && t->ndata == 0)
+      t->opened = ticks;
+  }
+  release(&log.lock);
+}
+
+// Caller has modified file data in b->data and is done with the
+// buffer.  Without FS_ORDERED this is log_write(); otherwise the
+// block is pinned and written in place when the transaction
+// closes, ahead of the metadata that refers to it.
+void
+log_data(struct buf *b)
+{
+  struct trans *t;
+  int i;
+
+  if(!log.ordered){
+    log_write(b);
+    return;
+  }
+
+  acquire(&log.lock);
+  t = log.cur;
+  if (log.outstanding < 1)
+    panic("log_data outside of trans");
+  if (trans_find(t, b->blockno) >= 0) {
+    // already logged as metadata; the log copy covers it.
+    release(&log.lock);
+    return;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  if (data_find(t, b->blockno) < 0) {
+    if (t->ndata >= LOGMAX)
+      panic("too much data in a transaction");
+    i = t->ndata++;
+    t->data[i] = b->blockno;
+    t->dnext[i] = t->dhead[b->blockno % LOGHASH];
+    t->dhead[b->blockno % LOGHASH] = i;
     bpin(b);
-    log.lh.n++;
+    if (i == 0 && t->lh.n == 0)
+      t->opened = ticks;
   }
   release(&log.lock);
 }
 
+// Caller has freed block b in the current transaction.
+// Remember it, to discard once the transaction commits, and
+// return the transaction's slot, for bunhold().
+int
+log_free(uint b)
+{
+  struct trans *t;
+  int i;
+
+  acquire(&log.lock);
+  t = log.cur;
+  for(i = 0; log.discard && i < t->ndiscard; i++){
+    if(t->dlist[i].start + t->dlist[i].n == b){
+      t->dlist[i].n++;
+      break;
+    }
+    if(b + 1 == t->dlist[i].start){
+      t->dlist[i].start--;
+      t->dlist[i].n++;
+      break;
+    }
+  }
+  // discarding is only a hint; if the list is full,
+  // the block stays allocated on the device.
+  if(log.discard && i == t->ndiscard && i < NDISCARD){
+    t->dlist[i].start = b;
+    t->dlist[i].n = 1;
+    t->ndiscard++;
+  }
+  release(&log.lock);
+  return t - log.trans;
+}
+
+// Caller has allocated block b in the current transaction.
+// If the transaction freed it earlier, it must not be discarded.
+void
+log_alloc(uint b)
+{
+  struct trans *t;
+  int i;
+  uint end;
+
+  if(!log.discard)
+    return;
+
+  acquire(&log.lock);
+  t = log.cur;
+  for(i = 0; i < t->ndiscard; i++){
+    end = t->dlist[i].start + t->dlist[i].n;
+    if(b < t->dlist[i].start || b >= end)
+      continue;
+    if(b == t->dlist[i].start){
+      t->dlist[i].start++;
+      t->dlist[i].n--;
+    } else if(b == end - 1){
+      t->dlist[i].n--;
+    } else if(t->ndiscard < NDISCARD){
+      // split the range around b.
+      t->dlist[t->ndiscard].start = b + 1;
+      t->dlist[t->ndiscard].n = end - (b + 1);
+      t->ndiscard++;
+      t->dlist[i].n = b - t->dlist[i].start;
+    } else {
+      // no room to split; keep the part before b.
+      t->dlist[i].n = b - t->dlist[i].start;
+    }
+    if(t->dlist[i].n == 0)
+      t->dlist[i] = t->dlist[--t->ndiscard];
+    break;
+  }
+  release(&log.lock);
+}
@@ -28,6 +28,7 @@ main()
     iinit();         // inode cache
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
+    iosched_init();  // disk request scheduler
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
@@ -7,8 +7,11 @@
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      1024  // blocks in on-disk log, unless mkfs -l says
+#define LOGMAX       2048  // max blocks in a transaction
+#define COMMITTICKS  5   // max ticks before a transaction commits
+#define NBUF         (MAXOPBLOCKS*3)  // initial size of disk block cache
+#define BCACHE_MAXPCT 10  // max % of RAM the disk block cache may grow to
 // TODO: bigfile. You need 200000 FSSIZE to finish Large Files.
 #define FSSIZE       200000// size of file system in blocks
 #define MAXPATH      128   // maximum file path name
@@ -16,6 +16,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -221,6 +222,22 @@ uchar initcode[] = {
   0x00, 0x00, 0x00, 0x00
 };
 
+// Start a kernel thread that runs fn(), which must never
+// return.  The thread has a process slot but no user memory.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->context.ra = (uint64)kthreadret;
+  p->kfn = fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Set up first user process.
 void
 userinit(void)
@@ -654,3 +671,14 @@ procdump(void)
     printf("\n");
   }
 }
+
+// A kernel thread's first scheduling will swtch here.
+static void
+kthreadret(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kthread returned");
+}
@@ -15,6 +15,9 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "bcstat.h"
+#include "dstat.h"
+#include "fsstat.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -115,6 +118,44 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Wait until the last transaction that changed f's inode,
+// or with data set only its contents and size, is on disk.
+// The log commits in the background, so a write() is not
+// durable until the caller fsync()s.
+static int
+fdsync(struct file *f, int data)
+{
+  uint seq;
+
+  if(f->type != FD_INODE && f->type != FD_DEVICE)
+    return -1;
+  ilock(f->ip);
+  seq = data ? f->ip->dseq : f->ip->seq;
+  iunlock(f->ip);
+  log_wait(seq);
+  return 0;
+}
+
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return fdsync(f, 0);
+}
+
+uint64
+sys_fdatasync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return fdsync(f, 1);
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -268,6 +309,7 @@ create(char *path, short type, short major, short minor)
   ip->minor = minor;
   ip->nlink = 1;
   iupdate(ip);
+  igroup(ip, dp);
 
   if(type == T_DIR){  // Create . and .. entries.
     dp->nlink++;  // for ".."
@@ -564,4 +606,51 @@ sys_symlink(void)
   // panic("You should implement symlink system call.");
 
   return 0;
-}
\ No newline at end of file
+}
+
+// Copy buffer cache statistics to user space.
+uint64
+sys_bcstat(void)
+{
+  uint64 addr;
+  int flags;
+  struct bcstat st;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &flags) < 0)
+    return -1;
+  bcachestat(&st, flags);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+uint64
+sys_dstat(void)
+{
+  uint64 addr;
+  int flags;
+  struct dstat st;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &flags) < 0)
+    return -1;
+  virtio_disk_stat(&st, flags);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// Copy block allocator statistics to user space.
+uint64
+sys_fsstat(void)
+{
+  uint64 addr;
+  int flags;
+  struct fsstat st;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &flags) < 0)
+    return -1;
+  fsstat(&st, flags);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
@@ -2,7 +2,8 @@
 // virtio device definitions.
 // for both the mmio interface, and virtio descriptors.
 // only tested with qemu.
-// this is the "legacy" virtio interface.
+// this is the "legacy" virtio interface, plus the parts of the
+// modern (version 2) mmio interface the driver uses.
 //
 // the virtio spec:
 // https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf
@@ -15,7 +16,9 @@
 #define VIRTIO_MMIO_DEVICE_ID		0x008 // device type; 1 is net, 2 is disk
 #define VIRTIO_MMIO_VENDOR_ID		0x00c // 0x554d4551
 #define VIRTIO_MMIO_DEVICE_FEATURES	0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL	0x014 // which 32 feature bits to read
 #define VIRTIO_MMIO_DRIVER_FEATURES	0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL	0x024 // which 32 feature bits to write
 #define VIRTIO_MMIO_GUEST_PAGE_SIZE	0x028 // page size for PFN, write-only
 #define VIRTIO_MMIO_QUEUE_SEL		0x030 // select queue, write-only
 #define VIRTIO_MMIO_QUEUE_NUM_MAX	0x034 // max size of current queue, read-only
@@ -27,6 +30,13 @@
 #define VIRTIO_MMIO_INTERRUPT_STATUS	0x060 // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK	0x064 // write-only
 #define VIRTIO_MMIO_STATUS		0x070 // read/write
+#define VIRTIO_MMIO_QUEUE_DESC_LOW	0x080 // physical address for descriptor table, write-only
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH	0x084
+#define VIRTIO_MMIO_DRIVER_DESC_LOW	0x090 // physical address for available ring, write-only
+#define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
+#define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
+#define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration space
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -37,15 +47,26 @@
 // device feature bits
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
+#define VIRTIO_BLK_F_FLUSH           9	/* Cache flush command support */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
+#define VIRTIO_BLK_F_DISCARD        13	/* Discard command support */
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32	/* modern interface */
+#define VIRTIO_F_RING_PACKED        34
 
-// this many virtio descriptors.
+// at most this many virtio descriptors; the driver uses
+// the largest power of two the device allows, up to NUM.
 // must be a power of two.
-#define NUM 8
+#define NUM 256
+
+// at most this many data buffers in one request.
+#define MAXSEG 16
+
+// at most this many virtqueues, with VIRTIO_BLK_F_MQ.
+#define NVQ 4
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -56,13 +77,14 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr points to a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
   uint16 flags; // always zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  // uint16 used_event follows ring[num], for the queue's actual num.
 };
 
 // one entry in the "used" ring, with which the
@@ -78,17 +100,62 @@ struct virtq_used {
   struct virtq_used_elem ring[NUM];
 };
 
+// a descriptor of a packed virtqueue, from Section 2.8 of the spec.
+// the descriptors form a ring that both the driver and the device
+// write: the driver makes one available by setting its AVAIL flag
+// to the driver's wrap counter and its USED flag to the inverse;
+// the device marks it used by setting both flags to its own wrap
+// counter.  the counters flip each time around the ring.
+struct virtq_packed_desc {
+  uint64 addr;
+  uint32 len;
+  uint16 id;    // buffer id, returned by the device when done
+  uint16 flags; // VRING_DESC_F_* and the two below
+};
+#define VRING_PACKED_DESC_F_AVAIL (1 << 7)
+#define VRING_PACKED_DESC_F_USED  (1 << 15)
+
+// packed virtqueue event suppression: the driver's structure says
+// when the device should interrupt, the device's when the driver
+// should notify.
+struct virtq_packed_event {
+  uint16 off_wrap; // ring offset, and wrap counter in bit 15
+  uint16 flags;
+};
+#define VRING_PACKED_EVENT_F_ENABLE  0
+#define VRING_PACKED_EVENT_F_DISABLE 1
+#define VRING_PACKED_EVENT_F_DESC    2 // at off_wrap; needs EVENT_IDX
+
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
+#define VIRTIO_BLK_T_FLUSH 4 // write the device's cache to stable storage
+#define VIRTIO_BLK_T_DISCARD 11 // the device may forget a range of sectors
+
+#define VIRTIO_BLK_S_OK 0 // request status
+
+// offset of the uint16 num_queues in the block device's
+// configuration space, valid with VIRTIO_BLK_F_MQ.
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
+// offset of the uint32 max_discard_sectors, valid with
+// VIRTIO_BLK_F_DISCARD.
+#define VIRTIO_BLK_CONFIG_MAX_DISCARD 36
 
 // the format of the first descriptor in a disk request.
-// to be followed by two more descriptors containing
-// the block, and a one-byte status.
+// to be followed by descriptors containing the blocks,
+// and a one-byte status.
 struct virtio_blk_req {
-  uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
+  uint32 type; // VIRTIO_BLK_T_IN, ..._OUT, ..._FLUSH or ..._DISCARD
   uint32 reserved;
   uint64 sector;
 };
+
+// the data of a discard request: a range of sectors.
+struct virtio_blk_discard {
+  uint64 sector;
+  uint32 num_sectors;
+  uint32 flags;
+};
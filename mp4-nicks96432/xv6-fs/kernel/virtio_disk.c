@@ -1,7 +1,17 @@
 //
 // driver for qemu's virtio disk device.
 // uses qemu's mmio interface to virtio.
-// qemu presents a "legacy" virtio interface.
+// qemu presents a "legacy" virtio interface by default, with which
+// the driver uses a split virtqueue.  with
+// -global virtio-mmio.force-legacy=false it presents the modern
+// (version 2) interface, with which the driver uses a packed
+// virtqueue if the device offers one (packed=on).
+// with VIRTIO_BLK_F_MQ (num-queues=n) each hart submits to
+// its own queue; see iosched.c.
+// with VIRTIO_BLK_F_FLUSH the device may cache writes, and
+// virtio_disk_flush() makes them durable.  with
+// VIRTIO_BLK_F_DISCARD (discard=on) the file system can tell
+// the device which blocks it no longer needs.
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
@@ -16,16 +26,44 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "dstat.h"
+
+// in polled mode, a process waiting for the disk checks the used
+// ring for this many timer cycles (100us) before it goes to sleep
+// and waits for the interrupt.
+#define POLLCYCLES 1000
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// with VIRTIO_RING_F_EVENT_IDX, the driver's used_event follows
+// the avail ring, and the device's avail_event follows the used ring.
+#define USED_EVENT(vq)  (((volatile uint16 *) (vq)->avail->ring)[disk.num])
+#define AVAIL_EVENT(vq) (*(volatile uint16 *) &(vq)->used->ring[disk.num])
+
+// has idx moved past event in going from old to new?
+// from Section 2.6.7.2 of the spec.
+#define NEED_EVENT(event, new, old) \
+  ((uint16)((new) - (event) - 1) < (uint16)((new) - (old)))
+
+// the legacy layout of a queue with n entries: the descriptors,
+// then the avail ring, then the used ring at the next page boundary.
+// a packed queue uses the space of the descriptors, followed by
+// the driver's and the device's event suppression structures.
+#define VQ_AVAIL(n) ((n) * sizeof(struct virtq_desc))
+#define VQ_USED(n)  PGROUNDUP(VQ_AVAIL(n) + 2*(3 + (n)))
+#define VQ_SIZE(n)  PGROUNDUP(VQ_USED(n) + 2*3 + sizeof(struct virtq_used_elem)*(n))
+
+// one virtqueue.  with VIRTIO_BLK_F_MQ the device has several,
+// each with its own lock, so that harts submitting at the same
+// time do not contend.
+struct vq {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
   // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
+  // contiguous pages of page-aligned physical memory, enough for a
+  // queue of NUM entries.
+  char pages[VQ_SIZE(NUM)];
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -34,54 +72,161 @@ static struct disk {
   
   // the first region of pages[] is a set (not a ring) of DMA
   // descriptors, with which the driver tells the device where to read
-  // and write individual disk operations. there are NUM descriptors.
+  // and write individual disk operations. there are num descriptors.
   // most commands consist of a "chain" (a linked list) of a couple of
-  // these descriptors.
+  // these descriptors, or, with indirect descriptors, of a single
+  // descriptor pointing to the chain in ind[].
+  // a request moves up to MAXSEG blocks with consecutive numbers.
   // points into pages[].
   struct virtq_desc *desc;
 
   // next is a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // num elements.
   // points into pages[].
   struct virtq_avail *avail;
 
   // finally a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are num used ring entries.
   // points into pages[].
   struct virtq_used *used;
 
+  // a packed virtqueue instead replaces all three with one ring
+  // of num descriptors, which the driver fills in order and the
+  // device hands back in order.  the driver uses it only with
+  // indirect descriptors, so a request takes exactly one slot.
+  // points into pages[].
+  struct virtq_packed_desc *ring;
+  struct virtq_packed_event *driver_event;
+  struct virtq_packed_event *device_event;
+
   // our own book-keeping.
-  char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  char free[NUM];  // is a descriptor free? (packed: a buffer id)
+  uint16 used_idx; // we've looked this far in used[2..num].
+  uint16 notified; // avail->idx when we last notified the device.
+  uint16 next_avail; // packed: next slot to make available
+  uint16 next_used;  // packed: next slot the device will use
+  char avail_wrap;   // packed: driver's wrap counter
+  char used_wrap;    // packed: device's wrap counter
+  uint16 nadded;     // packed: requests since the last notification
+  char freewait;     // is a command waiting for descriptors?
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // indexed by first descriptor index of chain,
+  // or by buffer id with a packed queue.
   struct {
     struct buf *b;
+    int *cmd;    // a command's waiter, which gets the status
     char status;
   } info[NUM];
 
+  // indirect descriptor tables, each holding the
+  // descriptors of one request.
+  // one-for-one with descriptors, for convenience.
+  struct virtq_desc ind[NUM][MAXSEG+2];
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
+
+  // the sector ranges of discard commands.
+  // one-for-one with descriptors, for convenience.
+  struct virtio_blk_discard dsc[NUM];
   
-  struct spinlock vdisk_lock;
+  struct spinlock lock;
   
-} __attribute__ ((aligned (PGSIZE))) disk;
+} __attribute__ ((aligned (PGSIZE)));
+
+static struct disk {
+  struct vq vq[NVQ];
+  int nvq;      // number of virtqueues in use
+  int num;      // queue size in use, a power of two <= NUM
+  int version;  // mmio interface: 1 is legacy, 2 is modern
+  int indirect; // device accepts VRING_DESC_F_INDIRECT?
+  int event_idx; // device uses used_event and avail_event?
+  int packed;   // packed virtqueues instead of desc/avail/used?
+  int flush;    // device caches writes until told to flush?
+  int discard;  // device accepts discard commands?
+  uint32 maxdiscard; // largest discard, in sectors
+
+  // polled mode, and statistics, updated atomically.
+  int poll;
+  struct dstat st;
+} disk;
+
+// set up virtqueue q.
+static void
+virtio_disk_initq(int q)
+{
+  struct vq *vq = &disk.vq[q];
+
+  initlock(&vq->lock, "virtio_disk");
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = q;
+  if(disk.version == 2 && *R(VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk queue should not be ready");
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
+  memset(vq->pages, 0, sizeof(vq->pages));
+
+  uint64 qdesc, qdriver, qdevice;
+  if(disk.packed){
+    // ring = pages -- num * virtq_packed_desc
+    // driver_event = pages + num*16, device_event after it
+    vq->ring = (struct virtq_packed_desc *) vq->pages;
+    vq->driver_event = (struct virtq_packed_event *)(vq->pages + VQ_AVAIL(disk.num));
+    vq->device_event = vq->driver_event + 1;
+    vq->avail_wrap = 1;
+    vq->used_wrap = 1;
+    if(disk.event_idx){
+      vq->driver_event->off_wrap = 1 << 15;
+      vq->driver_event->flags = VRING_PACKED_EVENT_F_DESC;
+    }
+    qdesc = (uint64) vq->ring;
+    qdriver = (uint64) vq->driver_event;
+    qdevice = (uint64) vq->device_event;
+  } else {
+    // desc = pages -- num * virtq_desc
+    // avail = pages + num*16 -- 2 * uint16, then num * uint16
+    // used = next page boundary -- 2 * uint16, then num * vRingUsedElem
+    vq->desc = (struct virtq_desc *) vq->pages;
+    vq->avail = (struct virtq_avail *)(vq->pages + VQ_AVAIL(disk.num));
+    vq->used = (struct virtq_used *) (vq->pages + VQ_USED(disk.num));
+    qdesc = (uint64) vq->desc;
+    qdriver = (uint64) vq->avail;
+    qdevice = (uint64) vq->used;
+  }
+
+  if(disk.version == 1){
+    // the legacy interface finds the rest of the
+    // queue from the page of the descriptors.
+    *R(VIRTIO_MMIO_QUEUE_ALIGN) = PGSIZE;
+    *R(VIRTIO_MMIO_QUEUE_PFN) = qdesc >> PGSHIFT;
+  } else {
+    *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = qdesc;
+    *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = qdesc >> 32;
+    *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = qdriver;
+    *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = qdriver >> 32;
+    *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = qdevice;
+    *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = qdevice >> 32;
+    *R(VIRTIO_MMIO_QUEUE_READY) = 1;
+  }
+
+  // all num descriptors start out unused.
+  for(int i = 0; i < disk.num; i++)
+    vq->free[i] = 1;
+}
 
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
+  disk.version = *R(VIRTIO_MMIO_VERSION);
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 1 ||
+     (disk.version != 1 && disk.version != 2) ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
      *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
     panic("could not find virtio disk");
@@ -93,60 +238,111 @@ virtio_disk_init(void)
   status |= VIRTIO_CONFIG_S_DRIVER;
   *R(VIRTIO_MMIO_STATUS) = status;
 
-  // negotiate features
+  // negotiate features. only the modern interface
+  // has feature bits above 31.
+  *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 0;
   uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  if(disk.version == 2){
+    *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 1;
+    features |= (uint64)*R(VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+  }
+  features &= 0xffffffffUL |
+    (1UL << VIRTIO_F_VERSION_1) | (1UL << VIRTIO_F_RING_PACKED);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
+#ifdef VIRTIO_NO_FLUSH
+  features &= ~(1 << VIRTIO_BLK_F_FLUSH);
+#endif
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
+#ifdef VIRTIO_NO_EVENT_IDX
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+#endif
+  if((features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) == 0)
+    features &= ~(1UL << VIRTIO_F_RING_PACKED);
+  *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  if(disk.version == 2){
+    *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+    *R(VIRTIO_MMIO_DRIVER_FEATURES) = features >> 32;
+  }
+
+  // with indirect descriptors each request takes one ring
+  // slot instead of three.
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+
+  // with event indexes, the driver and device each say how far
+  // the other may get before it needs a notification or an
+  // interrupt, so that a burst of requests or completions
+  // costs one of each.
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+
+  // a packed ring touches fewer cache lines per request than
+  // the three parts of a split one.
+  disk.packed = (features >> VIRTIO_F_RING_PACKED) & 1;
+
+  // a device that may cache writes only does so once we
+  // promise to flush; otherwise it writes through.
+  disk.flush = (features >> VIRTIO_BLK_F_FLUSH) & 1;
+
+  // discarding freed blocks lets a sparse image shrink.
+  disk.discard = (features >> VIRTIO_BLK_F_DISCARD) & 1;
+  if(disk.discard){
+    disk.maxdiscard = *(volatile uint32 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_MAX_DISCARD);
+    if(disk.maxdiscard < BSIZE / 512)
+      disk.discard = 0;
+  }
+
+  // with several queues, harts can submit in parallel.
+  disk.nvq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    disk.nvq = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    if(disk.nvq > NVQ)
+      disk.nvq = NVQ;
+    if(disk.nvq > NCPU)
+      disk.nvq = NCPU;
+    if(disk.nvq < 1)
+      disk.nvq = 1;
+  }
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
 
-  // tell device we're completely ready.
-  status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
-
-  *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
+  // a modern device may refuse the features.
+  if(disk.version == 2 && !(*R(VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK))
+    panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
+  // size the queues.  all of them have the same maximum.
   *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  disk.num = NUM;
+  while(disk.num > max)
+    disk.num /= 2;
+  if(disk.num < 8)
     panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
-  // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  if(disk.version == 1)
+    *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
+  for(int q = 0; q < disk.nvq; q++)
+    virtio_disk_initq(q);
 
-  disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // tell device we're completely ready.
+  status |= VIRTIO_CONFIG_S_DRIVER_OK;
+  *R(VIRTIO_MMIO_STATUS) = status;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *vq)
 {
-  for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+  for(int i = 0; i < disk.num; i++){
+    if(vq->free[i]){
+      vq->free[i] = 0;
       return i;
     }
   }
@@ -155,28 +351,38 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *vq, int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(vq->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *vq, int i)
 {
+  if(vq->freewait){
+    vq->freewait = 0;
+    wakeup(&vq->free[0]);
+  }
+  if(disk.packed){
+    // i is a buffer id; the ring slot needs no freeing.
+    if(i >= disk.num || vq->free[i])
+      panic("free_chain");
+    vq->free[i] = 1;
+    return;
+  }
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = vq->desc[i].flags;
+    int nxt = vq->desc[i].next;
+    free_desc(vq, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -184,46 +390,217 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_ndesc(struct vq *vq, int n, int *idx)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(vq);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(vq, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
+// does a packed device want a notification for the requests
+// in ring slots old..new-1?  from Section 2.8.10 of the spec.
+static int
+need_notify_packed(struct vq *vq, uint16 new, uint16 old)
+{
+  uint16 off_wrap = vq->device_event->off_wrap;
+  uint16 flags = vq->device_event->flags;
+  uint16 event;
+
+  if(flags != VRING_PACKED_EVENT_F_DESC)
+    return flags != VRING_PACKED_EVENT_F_DISABLE;
+  event = off_wrap & ~(1 << 15);
+  if((off_wrap >> 15) != vq->avail_wrap)
+    event -= disk.num;
+  return NEED_EVENT(event, new, old);
+}
+
+// tell the device about requests added to queue q by
+// virtio_disk_start() since the last notification, unless
+// the device has said it will find them without one.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_notify(int q)
+{
+  struct vq *vq = &disk.vq[q];
+
+  acquire(&vq->lock);
+
+  if(disk.packed){
+    if(vq->nadded > 0){
+      uint16 new = vq->next_avail;
+      uint16 old = new - vq->nadded;
+      vq->nadded = 0;
+      __sync_synchronize();
+      if(need_notify_packed(vq, new, old)){
+        *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q; // value is queue number
+        __sync_fetch_and_add(&disk.st.notifies, 1);
+      }
+    }
+    release(&vq->lock);
+    return;
+  }
+
+  uint16 new = vq->avail->idx;
+  uint16 old = vq->notified;
+
+  if(new != old){
+    // the device must see the new avail->idx before
+    // we look at how far it has read.
+    __sync_synchronize();
+    if(!disk.event_idx || NEED_EVENT(AVAIL_EVENT(vq), new, old)){
+      *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q; // value is queue number
+      __sync_fetch_and_add(&disk.st.notifies, 1);
+    }
+    vq->notified = new;
+  }
+
+  release(&vq->lock);
+}
+
+// fill in descriptor i of the n in a request's chain d,
+// whose descriptors are numbered by nxt[].
+static void
+set_desc(struct virtq_desc *d, int *nxt, int i, int n, uint64 addr, uint32 len, int flags)
+{
+  if(disk.packed){
+    // a packed queue's indirect table has packed descriptors,
+    // which form a chain just by being in order.
+    struct virtq_packed_desc *pd = (struct virtq_packed_desc *) d;
+    pd[i].addr = addr;
+    pd[i].len = len;
+    pd[i].id = 0;
+    pd[i].flags = flags;
+    return;
+  }
+  d[nxt[i]].addr = addr;
+  d[nxt[i]].len = len;
+  if(i < n - 1){
+    d[nxt[i]].flags = flags | VRING_DESC_F_NEXT;
+    d[nxt[i]].next = nxt[i+1];
+  } else {
+    d[nxt[i]].flags = flags;
+    d[nxt[i]].next = 0;
+  }
+}
+
+// make the request whose n descriptors (or, with indirect
+// descriptors, whose table) start at id available to the device.
+// caller holds vq->lock.
+static void
+virtio_disk_post(struct vq *vq, int id, int n)
 {
+  if(disk.packed){
+    // the request's one slot in the ring points to its table.
+    struct virtq_packed_desc *pd = &vq->ring[vq->next_avail];
+    pd->addr = (uint64) vq->ind[id];
+    pd->len = n * sizeof(struct virtq_packed_desc);
+    pd->id = id;
+
+    __sync_synchronize();
+
+    // the flags make the slot available, so they go last.
+    pd->flags = VRING_DESC_F_INDIRECT |
+      (vq->avail_wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED);
+    if(++vq->next_avail == disk.num){
+      vq->next_avail = 0;
+      vq->avail_wrap ^= 1;
+    }
+    vq->nadded++;
+  } else {
+    if(disk.indirect){
+      vq->desc[id].addr = (uint64) vq->ind[id];
+      vq->desc[id].len = n * sizeof(struct virtq_desc);
+      vq->desc[id].flags = VRING_DESC_F_INDIRECT;
+      vq->desc[id].next = 0;
+    }
+
+    // tell the device the first index in our chain of descriptors.
+    vq->avail->ring[vq->avail->idx % disk.num] = id;
+
+    __sync_synchronize();
+
+    // tell the device another avail ring entry is available.
+    vq->avail->idx += 1; // not % NUM ...
+  }
+
+  __sync_synchronize();
+}
+
+// the number of virtqueues; see iosched.c.
+int
+virtio_disk_nqueue(void)
+{
+  return disk.nvq;
+}
+
+// the largest number of blocks one request may carry.
+int
+virtio_disk_maxseg(void)
+{
+  if(disk.indirect)
+    return MAXSEG;
+  // a direct chain must leave room in the ring for
+  // at least one more request.
+  return disk.num/2 - 2 < MAXSEG ? disk.num/2 - 2 : MAXSEG;
+}
+
+// hand the device a request, on queue q, for nseg blocks with
+// consecutive block numbers, starting with b and linked through
+// b->qnext.
+// returns -1, and leaves the request alone, if the ring
+// does not have room for it.
+// the device may not see the request until virtio_disk_notify().
+// when the request completes, virtio_disk_intr() clears
+// b->disk for each block and wakes up waiters in
+// virtio_disk_wait(), or, if b->async is set, calls biodone(b).
+int
+virtio_disk_start(int q, struct buf *b, int write, int nseg)
+{
+  struct vq *vq = &disk.vq[q];
   uint64 sector = b->blockno * (BSIZE / 512);
+  struct virtq_desc *d;
+  struct buf *s;
+  int idx[MAXSEG+2], nxt[MAXSEG+2];
+  int i, n;
 
-  acquire(&disk.vdisk_lock);
+  if(nseg < 1 || nseg > MAXSEG)
+    panic("virtio_disk_start");
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, descriptors for the
+  // data, and one for a 1-byte status result.
+  n = nseg + 2;
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  acquire(&vq->lock);
+
+  // with indirect descriptors, the request takes a single
+  // ring descriptor, pointing to its table in ind[].
+  if(alloc_ndesc(vq, disk.indirect ? 1 : n, idx) < 0){
+    release(&vq->lock);
+    return -1;
   }
 
-  // format the three descriptors.
+  if(disk.indirect){
+    d = vq->ind[idx[0]];
+    for(i = 0; i < n; i++)
+      nxt[i] = i;
+  } else {
+    d = vq->desc;
+    for(i = 0; i < n; i++)
+      nxt[i] = idx[i];
+  }
+
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &vq->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -232,57 +609,302 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  set_desc(d, nxt, 0, n, (uint64) buf0, sizeof(struct virtio_blk_req), 0);
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1, s = b; i <= nseg; i++, s = s->qnext){
+    s->iostart = r_time();
+    if(write)
+      set_desc(d, nxt, i, n, (uint64) s->data, BSIZE, 0); // device reads s->data
+    else
+      set_desc(d, nxt, i, n, (uint64) s->data, BSIZE, VRING_DESC_F_WRITE); // device writes s->data
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  vq->info[idx[0]].status = 0xff; // device writes 0 on success
+  set_desc(d, nxt, n-1, n, (uint64) &vq->info[idx[0]].status, 1,
+           VRING_DESC_F_WRITE); // device writes the status
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  vq->info[idx[0]].b = b;
+  vq->info[idx[0]].cmd = 0;
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  virtio_disk_post(vq, idx[0], n);
 
-  __sync_synchronize();
+  __sync_fetch_and_add(&disk.st.requests, 1);
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  release(&vq->lock);
+  return 0;
+}
 
-  __sync_synchronize();
+// send the device a command of the given type that moves no
+// blocks and wait for it.  a discard command covers nsect
+// sectors from sector.  returns the status the device
+// reports: VIRTIO_BLK_S_OK or an error.
+static int
+virtio_disk_cmd(int q, int type, uint64 sector, uint32 nsect)
+{
+  struct vq *vq = &disk.vq[q];
+  struct virtq_desc *d;
+  int idx[3], nxt[3];
+  int i, n, status;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  n = type == VIRTIO_BLK_T_DISCARD ? 3 : 2;
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  acquire(&vq->lock);
+
+  // unlike block requests, which the scheduler holds back
+  // and retries, a command waits here for room in the ring.
+  while(alloc_ndesc(vq, disk.indirect ? 1 : n, idx) < 0){
+    vq->freewait = 1;
+    sleep(&vq->free[0], &vq->lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  if(disk.indirect){
+    d = vq->ind[idx[0]];
+    for(i = 0; i < n; i++)
+      nxt[i] = i;
+  } else {
+    d = vq->desc;
+    for(i = 0; i < n; i++)
+      nxt[i] = idx[i];
+  }
+
+  struct virtio_blk_req *buf0 = &vq->ops[idx[0]];
+  buf0->type = type;
+  buf0->reserved = 0;
+  buf0->sector = 0;
+
+  set_desc(d, nxt, 0, n, (uint64) buf0, sizeof(struct virtio_blk_req), 0);
+  if(type == VIRTIO_BLK_T_DISCARD){
+    struct virtio_blk_discard *ds = &vq->dsc[idx[0]];
+    ds->sector = sector;
+    ds->num_sectors = nsect;
+    ds->flags = 0;
+    set_desc(d, nxt, 1, n, (uint64) ds, sizeof(*ds), 0); // device reads ds
+  }
+  vq->info[idx[0]].status = 0xff;
+  set_desc(d, nxt, n-1, n, (uint64) &vq->info[idx[0]].status, 1,
+           VRING_DESC_F_WRITE);
+
+  status = -1;
+  vq->info[idx[0]].b = 0;
+  vq->info[idx[0]].cmd = &status;
+
+  virtio_disk_post(vq, idx[0], n);
 
-  release(&disk.vdisk_lock);
+  __sync_fetch_and_add(&disk.st.requests, 1);
+
+  release(&vq->lock);
+
+  virtio_disk_notify(q);
+
+  acquire(&vq->lock);
+  while(status == -1)
+    sleep(&status, &vq->lock);
+  release(&vq->lock);
+
+  return status;
 }
 
+// make the writes that have completed on the disk durable,
+// if the device caches them.
+void
+virtio_disk_flush(int q)
+{
+  if(!disk.flush)
+    return;
+  __sync_fetch_and_add(&disk.st.flushes, 1);
+  if(virtio_disk_cmd(q, VIRTIO_BLK_T_FLUSH, 0, 0) != VIRTIO_BLK_S_OK)
+    panic("virtio_disk_flush");
+}
+
+// tell the device that blocks blockno..blockno+n-1 hold
+// nothing of value, if it wants to know.
+void
+virtio_disk_discard(int q, uint blockno, uint n)
+{
+  uint64 sector = (uint64) blockno * (BSIZE / 512);
+  uint64 nsect = (uint64) n * (BSIZE / 512);
+  uint32 len;
+
+  while(disk.discard && nsect > 0){
+    len = nsect < disk.maxdiscard ? nsect : disk.maxdiscard;
+    len -= len % (BSIZE / 512);
+    // a device may offer discard but not support it on
+    // its backing store; it is only a hint, so stop asking.
+    if(virtio_disk_cmd(q, VIRTIO_BLK_T_DISCARD, sector, len) != VIRTIO_BLK_S_OK){
+      disk.discard = 0;
+      break;
+    }
+    __sync_fetch_and_add(&disk.st.discards, 1);
+    sector += len;
+    nsect -= len;
+  }
+}
+
+// finish the request whose chain starts at descriptor id.
+// returns 1 for a block request, 0 for a command, which
+// iosched never counted as in flight.
+// caller holds vq->lock.
+static int
+virtio_disk_done(struct vq *vq, int id)
+{
+  if(vq->info[id].cmd){
+    // a command; its waiter checks the status.
+    *vq->info[id].cmd = vq->info[id].status;
+    wakeup(vq->info[id].cmd);
+    vq->info[id].cmd = 0;
+    free_chain(vq, id);
+    return 0;
+  }
+
+  if(vq->info[id].status != 0)
+    panic("virtio_disk_intr status");
+
+  struct buf *b = vq->info[id].b, *nb;
+  vq->info[id].b = 0;
+  free_chain(vq, id);
+
+  for(; b; b = nb){
+    nb = b->qnext; // b may be reused once it is released
+    b->disk = 0;   // disk is done with buf
+    if(b->async)
+      biodone(b);
+    else
+      wakeup(b);
+  }
+  return 1;
+}
+
+// has the device used the next slot of the packed ring?
+static int
+packed_used(struct vq *vq)
+{
+  uint16 flags = vq->ring[vq->next_used].flags;
+  int avail = (flags & VRING_PACKED_DESC_F_AVAIL) != 0;
+  int used = (flags & VRING_PACKED_DESC_F_USED) != 0;
+
+  return avail == used && used == vq->used_wrap;
+}
+
+// virtio_disk_reap() for a packed queue.
+static int
+virtio_disk_reap_packed(struct vq *vq)
+{
+  int ndone = 0;
+
+  for(;;){
+    while(packed_used(vq)){
+      __sync_synchronize();
+      ndone += virtio_disk_done(vq, vq->ring[vq->next_used].id);
+      if(++vq->next_used == disk.num){
+        vq->next_used = 0;
+        vq->used_wrap ^= 1;
+      }
+    }
+    if(!disk.event_idx)
+      break;
+    // ask for an interrupt when the next slot is used,
+    // and look again, as for a split queue.
+    vq->driver_event->off_wrap = vq->next_used | (vq->used_wrap << 15);
+    __sync_synchronize();
+    if(!packed_used(vq))
+      break;
+  }
+
+  return ndone;
+}
+
+// finish the requests the device has completed on vq.
+// caller holds vq->lock, and must pass the returned count
+// of block requests to iosched_done() after releasing it.
+static int
+virtio_disk_reap(struct vq *vq)
+{
+  int ndone = 0;
+
+  if(disk.packed)
+    return virtio_disk_reap_packed(vq);
+
+  // the device increments vq->used->idx when it
+  // adds an entry to the used ring.
+
+again:
+  while(vq->used_idx != vq->used->idx){
+    __sync_synchronize();
+    ndone += virtio_disk_done(vq, vq->used->ring[vq->used_idx % disk.num].id);
+    vq->used_idx += 1;
+  }
+
+  if(disk.event_idx){
+    // ask for an interrupt when the next request completes.
+    // one that completed before the device saw this
+    // raised none, so look again.
+    USED_EVENT(vq) = vq->used_idx;
+    __sync_synchronize();
+    if(vq->used_idx != vq->used->idx)
+      goto again;
+  }
+
+  return ndone;
+}
+
+// record how long b took, from submit until its waiter ran.
+static void
+virtio_disk_account(struct buf *b)
+{
+  uint64 t = r_time() - b->iostart;
+  int i;
+
+  for(i = 0; i < DSTAT_NHIST - 1 && t >= 2; i++)
+    t >>= 1;
+  __sync_fetch_and_add(&disk.st.hist[i], 1);
+  __sync_fetch_and_add(&disk.st.waits, 1);
+}
+
+// wait for a request submitted for b to complete.
+// in polled mode, first check for the completion ourselves
+// for a while, which saves the sleep and the switch to another
+// process when the disk is fast.  the device still interrupts,
+// since nothing turns its notifications off, but the handler
+// then finds the used ring already reaped.
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct vq *vq = &disk.vq[b->qid];
+  uint64 t0;
+  int ndone;
+
+  acquire(&vq->lock);
+  if(disk.poll && b->disk == 1){
+    t0 = r_time();
+    while(b->disk == 1 && r_time() - t0 < POLLCYCLES){
+      ndone = virtio_disk_reap(vq);
+      release(&vq->lock);
+      if(ndone > 0)
+        iosched_done(b->qid, ndone);
+      acquire(&vq->lock);
+    }
+    if(b->disk == 1)
+      __sync_fetch_and_add(&disk.st.pollmisses, 1);
+    else
+      __sync_fetch_and_add(&disk.st.pollhits, 1);
+  }
+  while(b->disk == 1) {
+    sleep(b, &vq->lock);
+  }
+  virtio_disk_account(b);
+  release(&vq->lock);
+}
+
+// virtio-mmio has one interrupt for all the queues, so there
+// is no way to send a completion back to the hart that
+// submitted it; whichever hart takes the interrupt reaps
+// every queue.
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
+  struct vq *vq;
+  int q, ndone;
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
@@ -294,22 +916,39 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+  __sync_fetch_and_add(&disk.st.intrs, 1);
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+  for(q = 0; q < disk.nvq; q++){
+    vq = &disk.vq[q];
+    acquire(&vq->lock);
+    ndone = virtio_disk_reap(vq);
+    release(&vq->lock);
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
+    // the completions freed descriptors for queued requests.
+    if(ndone > 0)
+      iosched_done(q, ndone);
   }
+}
 
-  release(&disk.vdisk_lock);
+// copy the disk statistics to *st, then apply flags.
+// the counters are updated without a lock, so a copy
+// taken while the disk is busy may be slightly stale.
+void
+virtio_disk_stat(struct dstat *st, int flags)
+{
+  if(flags & DSTAT_POLL_ON)
+    disk.poll = 1;
+  if(flags & DSTAT_POLL_OFF)
+    disk.poll = 0;
+  disk.st.poll = disk.poll;
+  disk.st.event_idx = disk.event_idx;
+  disk.st.version = disk.version;
+  disk.st.packed = disk.packed;
+  disk.st.nqueue = disk.nvq;
+  disk.st.flush = disk.flush;
+  disk.st.discard = disk.discard;
+  disk.st.pollcycles = POLLCYCLES;
+  *st = disk.st;
+  if(flags & DSTAT_RESET)
+    memset(&disk.st, 0, sizeof(disk.st));
 }
@@ -20,7 +20,8 @@
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
+int ngroups = (FSSIZE + BPG - 1) / BPG;  // allocation groups
+int nbitmap = (FSSIZE + BPG - 1) / BPG * GROUPBMAP;
 int ninodeblocks = NINODES / IPB + 1;
 int nlog = LOGSIZE;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
@@ -40,6 +41,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint emap(struct dinode *din, uint fbn);
 
 // convert to intel byte order
 ushort
@@ -72,12 +74,39 @@ main(int argc, char *argv[])
   struct dirent de;
   char buf[BSIZE];
   struct dinode din;
-
+  uint flags = 0;
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  // options come before the image name.
+  while(argc > 1 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-d") == 0)
+      flags |= FS_DISCARD;
+    else if(strcmp(argv[1], "-o") == 0)
+      flags |= FS_ORDERED;
+    else if(strcmp(argv[1], "-e") == 0)
+      flags |= FS_EXTENT;
+    else if(strcmp(argv[1], "-l") == 0 && argc > 2){
+      nlog = atoi(argv[2]);
+      argc--;
+      argv++;
+    } else {
+      fprintf(stderr, "Usage: mkfs [-d] [-o] [-e] [-l nlog] fs.img files...\n");
+      exit(1);
+    }
+    argc--;
+    argv++;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-d] [-o] [-e] [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+
+  // the kernel needs room for the header and a
+  // transaction of MAXOPBLOCKS.
+  if(nlog < MAXOPBLOCKS + 1 || nlog > FSSIZE / 2){
+    fprintf(stderr, "mkfs: bad log size %d\n", nlog);
     exit(1);
   }
 
@@ -102,6 +131,7 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.flags = xint(flags);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -236,30 +266,65 @@ ialloc(ushort type)
 
   bzero(&din, sizeof(din));
   din.type = xshort(type);
+  if(xint(sb.flags) & FS_EXTENT)
+    din.flags = DI_EXTENT;
   din.nlink = xshort(1);
   din.size = xint(0);
   winode(inum, &din);
   return inum;
 }
 
+// Mark the first used blocks allocated, in as many bitmap
+// blocks, and so allocation groups, as they take.
 void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  printf("balloc: %d allocation groups of %d blocks\n", ngroups, BPG);
+  assert(used <= FSSIZE);
+  for(b = 0; b * BPB < used; b++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB && b * BPB + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b);
+    wsect(sb.bmapstart + b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding block fbn of extent-mapped din,
+// allocating it if fbn is just past the end.  mkfs writes
+// each file in one go, so its blocks are contiguous, and
+// NEXTENT extents are plenty.
+uint
+emap(struct dinode *din, uint fbn)
+{
+  struct extent *e = (struct extent*)din->addrs;
+  int i;
+
+  for(i = 0; i < NEXTENT && xint(e[i].len) != 0; i++){
+    if(fbn < xint(e[i].len))
+      return xint(e[i].start) + fbn;
+    fbn -= xint(e[i].len);
+  }
+  assert(fbn == 0);
+  if(i > 0 && xint(e[i-1].start) + xint(e[i-1].len) == freeblock){
+    e[i-1].len = xint(xint(e[i-1].len) + 1);
+  } else if(i < NEXTENT){
+    e[i].start = xint(freeblock);
+    e[i].len = xint(1);
+  } else {
+    fprintf(stderr, "mkfs: too many extents\n");
+    exit(1);
+  }
+  return freeblock++;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -276,7 +341,9 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(din.flags & DI_EXTENT){
+      x = emap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
@@ -0,0 +1,92 @@
+// Block allocator benchmark.
+//
+// Fills the file system with files, written nper blocks at a
+// time, until it is pct percent full, and prints for each
+// percent the timer cycles balloc() took to find a block and
+// the bitmap blocks it searched per 100 blocks, from fsstat().
+// The files are removed at the end.  balloc() panics if the
+// disk fills up, so pct stops short of 100.
+//
+// usage: allocbench [pct [nper]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fsstat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+
+#define FILEBLOCKS 10000  // blocks per file
+
+int
+main(int argc, char *argv[])
+{
+  int pct = 95, nper = 16;
+  int fd, i, nfile, inf, used, last;
+  char path[] = "abench00";
+  char *buf;
+  struct fsstat st;
+
+  if(argc > 1)
+    pct = atoi(argv[1]);
+  if(argc > 2)
+    nper = atoi(argv[2]);
+  if(pct < 1 || pct > 99 || nper < 1 || nper > 64){
+    printf("usage: allocbench [pct (1-99) [nper (1-64)]]\n");
+    exit(1);
+  }
+  buf = malloc(nper * BSIZE);
+  memset(buf, 'a', nper * BSIZE);
+
+  fsstat(&st, FSSTAT_RESET);
+  last = (st.size - st.nfree) * 100 / st.size;
+  printf("%d blocks, %d%% full\n", st.size, last);
+  printf("full  allocs  cycles/alloc  scans/100 allocs\n");
+
+  fd = -1;
+  nfile = inf = 0;
+  for(;;){
+    if(fd < 0 || inf + nper > FILEBLOCKS){
+      if(fd >= 0)
+        close(fd);
+      if(nfile == 100){
+        printf("allocbench: too many files\n");
+        break;
+      }
+      path[6] = '0' + nfile / 10;
+      path[7] = '0' + nfile % 10;
+      if((fd = open(path, O_CREATE | O_WRONLY)) < 0){
+        printf("allocbench: cannot create %s\n", path);
+        exit(1);
+      }
+      nfile++;
+      inf = 0;
+    }
+    if(write(fd, buf, nper * BSIZE) != nper * BSIZE){
+      printf("allocbench: write failed\n");
+      break;
+    }
+    inf += nper;
+
+    fsstat(&st, 0);
+    used = (st.size - st.nfree) * 100 / st.size;
+    if(used > last){
+      fsstat(&st, FSSTAT_RESET);
+      if(st.allocs > 0)
+        printf("%d%%  %l  %l  %l\n", used, st.allocs,
+               st.alloctime / st.allocs, st.bmscans * 100 / st.allocs);
+      last = used;
+      if(used >= pct)
+        break;
+    }
+  }
+  if(fd >= 0)
+    close(fd);
+
+  for(i = 0; i < nfile; i++){
+    path[6] = '0' + i / 10;
+    path[7] = '0' + i % 10;
+    unlink(path);
+  }
+  exit(0);
+}
@@ -0,0 +1,103 @@
+// Buffer cache scalability benchmark.
+//
+// Forks nproc readers, each of which repeatedly opens and
+// reads its own small file.  The files fit in the buffer
+// cache, so after the first pass every read is a cache hit
+// and the run time is dominated by bget()/brelse().
+// Run with different CPUS= settings to see how throughput
+// scales with the number of harts.
+//
+// usage: bcachebench [nproc [rounds]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+
+#define FBLOCKS 2   // blocks per file
+
+char buf[BSIZE];
+
+void
+makefile(char *path)
+{
+  int fd, i;
+
+  fd = open(path, O_CREATE | O_WRONLY);
+  if(fd < 0){
+    printf("bcachebench: cannot create %s\n", path);
+    exit(1);
+  }
+  memset(buf, 'a', sizeof(buf));
+  for(i = 0; i < FBLOCKS; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bcachebench: write %s failed\n", path);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+reader(char *path, int rounds)
+{
+  int fd, i, j;
+
+  for(i = 0; i < rounds; i++){
+    fd = open(path, O_RDONLY);
+    if(fd < 0){
+      printf("bcachebench: cannot open %s\n", path);
+      exit(1);
+    }
+    for(j = 0; j < FBLOCKS; j++){
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf("bcachebench: read %s failed\n", path);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nproc = 4, rounds = 500;
+  int i, t0, t1;
+  char path[] = "bcbench0";
+
+  if(argc > 1)
+    nproc = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(nproc < 1 || nproc > 8 || rounds < 1){
+    printf("usage: bcachebench [nproc (1-8) [rounds]]\n");
+    exit(1);
+  }
+
+  for(i = 0; i < nproc; i++){
+    path[7] = '0' + i;
+    makefile(path);
+  }
+
+  t0 = uptime();
+  for(i = 0; i < nproc; i++){
+    path[7] = '0' + i;
+    if(fork() == 0)
+      reader(path, rounds);
+  }
+  for(i = 0; i < nproc; i++)
+    wait(0);
+  t1 = uptime();
+
+  printf("bcachebench: %d procs, %d block reads in %d ticks\n",
+         nproc, nproc * rounds * FBLOCKS, t1 - t0);
+
+  for(i = 0; i < nproc; i++){
+    path[7] = '0' + i;
+    unlink(path);
+  }
+  exit(0);
+}
@@ -0,0 +1,49 @@
+// Print buffer cache statistics.
+//
+// usage: bcstat [-r] [-d]
+//   -r  reset the counters after printing them
+//   -d  drop unused blocks from the cache
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/bcstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct bcstat st;
+  int flags = 0;
+  int i;
+
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-r") == 0)
+      flags |= BCSTAT_RESET;
+    else if(strcmp(argv[i], "-d") == 0)
+      flags |= BCSTAT_DROP;
+    else {
+      fprintf(2, "usage: bcstat [-r] [-d]\n");
+      exit(1);
+    }
+  }
+
+  if(bcstat(&st, flags) < 0){
+    fprintf(2, "bcstat: failed\n");
+    exit(1);
+  }
+
+  printf("policy     %s\n", st.policy == BCPOLICY_2Q ? "2q" : "lru");
+  printf("buffers    %d (high water %d, max %d)\n", st.nbuf, st.hiwat, st.maxbuf);
+  printf("lookups    %l\n", st.lookups);
+  printf("hits       %l\n", st.hits);
+  printf("misses     %l\n", st.misses);
+  if(st.hits + st.misses > 0)
+    printf("hit rate   %d%%\n", (int)(st.hits * 100 / (st.hits + st.misses)));
+  printf("evictions  %l\n", st.evictions);
+  printf("pins       %l (%d pinned now)\n", st.pins, st.pinned);
+  printf("lockwait   %l cycles\n", st.lockwait);
+  printf("sleepwait  %l cycles\n", st.sleepwait);
+  if(flags & BCSTAT_RESET)
+    printf("counters reset\n");
+  exit(0);
+}
@@ -5,12 +5,19 @@
 #include "kernel/fs.h"
 #define TARGET_BLOCK_NUM 66666
 
+// usage: bigfile [blocks per write]
 int
-main()
+main(int argc, char *argv[])
 {
-  char buf[BSIZE];
-  int fd, i, blocks;
+  char *buf;
+  int fd, i, j, blocks, nper, t0;
 
+  nper = argc > 1 ? atoi(argv[1]) : 1;
+  if(nper < 1 || TARGET_BLOCK_NUM % nper != 0){
+    printf("bigfile: blocks per write must divide %d\n", TARGET_BLOCK_NUM);
+    exit(-1);
+  }
+  buf = malloc(nper * BSIZE);
 
   fd = open("big.file", O_CREATE | O_WRONLY);
   if(fd < 0){
@@ -18,20 +25,22 @@ main()
     exit(-1);
   }
 
+  t0 = uptime();
   blocks = 0;
   while(1){
-    *(int*)buf = blocks;
-    int cc = write(fd, buf, sizeof(buf));
-    if(cc <= 0)
+    for(j = 0; j < nper; j++)
+      *(int*)(buf + j*BSIZE) = blocks + j;
+    int cc = write(fd, buf, nper * BSIZE);
+    if(cc != nper * BSIZE)
       break;
-    blocks++;
-    if (blocks % 100 == 0)
-      printf(".");
+    for(j = 0; j < nper; j++)
+      if (++blocks % 100 == 0)
+        printf(".");
     if(blocks == TARGET_BLOCK_NUM)
       break;
   }
 
-  printf("\nwrote %d blocks\n", blocks);
+  printf("\nwrote %d blocks in %d ticks\n", blocks, uptime() - t0);
   if(blocks != TARGET_BLOCK_NUM) {
     printf("bigfile: file is too small\n");
     exit(-1);
@@ -44,7 +53,7 @@ main()
     exit(-1);
   }
   for(i = 0; i < blocks; i++){
-    int cc = read(fd, buf, sizeof(buf));
+    int cc = read(fd, buf, BSIZE);
     if(cc <= 0){
       printf("bigfile: read error at block %d\n", i);
       exit(-1);
@@ -0,0 +1,115 @@
+// Disk throughput benchmark.
+//
+// Forks nproc readers, each of which reads its own file of
+// nblocks blocks from start to end.  The buffer cache is
+// emptied first, so every block comes from the disk, and with
+// readahead and several readers the virtio queue holds many
+// requests at once.  Compare runs with different nproc to see
+// how well the disk path overlaps requests, or runs with
+// "make qemu VIRTIO=legacy|split|packed" to compare virtio
+// interfaces.
+//
+// usage: diskbench [nproc [nblocks]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/bcstat.h"
+#include "kernel/dstat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+
+char buf[BSIZE];
+
+void
+makefile(char *path, int nblocks)
+{
+  int fd, i;
+
+  fd = open(path, O_CREATE | O_WRONLY);
+  if(fd < 0){
+    printf("diskbench: cannot create %s\n", path);
+    exit(1);
+  }
+  memset(buf, 'a', sizeof(buf));
+  for(i = 0; i < nblocks; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("diskbench: write %s failed\n", path);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+reader(char *path, int nblocks)
+{
+  int fd, i;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0){
+    printf("diskbench: cannot open %s\n", path);
+    exit(1);
+  }
+  for(i = 0; i < nblocks; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("diskbench: read %s failed\n", path);
+      exit(1);
+    }
+  }
+  close(fd);
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nproc = 4, nblocks = 256;
+  int i, t0, t1;
+  char path[] = "dkbench0";
+  struct bcstat st;
+  struct dstat ds;
+
+  if(argc > 1)
+    nproc = atoi(argv[1]);
+  if(argc > 2)
+    nblocks = atoi(argv[2]);
+  if(nproc < 1 || nproc > 8 || nblocks < 1){
+    printf("usage: diskbench [nproc (1-8) [nblocks]]\n");
+    exit(1);
+  }
+
+  for(i = 0; i < nproc; i++){
+    path[7] = '0' + i;
+    makefile(path, nblocks);
+  }
+
+  if(bcstat(&st, BCSTAT_DROP) < 0){
+    printf("diskbench: cannot drop the buffer cache\n");
+    exit(1);
+  }
+  dstat(&ds, DSTAT_RESET);
+
+  t0 = uptime();
+  for(i = 0; i < nproc; i++){
+    path[7] = '0' + i;
+    if(fork() == 0)
+      reader(path, nblocks);
+  }
+  for(i = 0; i < nproc; i++)
+    wait(0);
+  t1 = uptime();
+
+  printf("diskbench: %d procs, %d uncached block reads in %d ticks\n",
+         nproc, nproc * nblocks, t1 - t0);
+  if(dstat(&ds, 0) == 0)
+    printf("diskbench: %s %s ring, %l requests, %l notifies, %l interrupts\n",
+           ds.version == 2 ? "modern" : "legacy", ds.packed ? "packed" : "split",
+           ds.requests, ds.notifies, ds.intrs);
+
+  for(i = 0; i < nproc; i++){
+    path[7] = '0' + i;
+    unlink(path);
+  }
+  exit(0);
+}
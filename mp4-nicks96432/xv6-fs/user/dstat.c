@@ -0,0 +1,69 @@
+// Print disk statistics and switch polled mode.
+//
+// usage: dstat [-r] [-p | -i]
+//   -r  reset the counters after printing them
+//   -p  wait for the disk by polling, then sleeping
+//   -i  wait for the disk interrupt only
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/dstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct dstat st;
+  int flags = 0;
+  int i;
+
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-r") == 0)
+      flags |= DSTAT_RESET;
+    else if(strcmp(argv[i], "-p") == 0)
+      flags |= DSTAT_POLL_ON;
+    else if(strcmp(argv[i], "-i") == 0)
+      flags |= DSTAT_POLL_OFF;
+    else {
+      fprintf(2, "usage: dstat [-r] [-p | -i]\n");
+      exit(1);
+    }
+  }
+
+  if(dstat(&st, flags) < 0){
+    fprintf(2, "dstat: failed\n");
+    exit(1);
+  }
+
+  if(st.poll)
+    printf("mode       polled (%d cycles)\n", st.pollcycles);
+  else
+    printf("mode       interrupt\n");
+  printf("interface  %s, %s ring\n", st.version == 2 ? "modern" : "legacy",
+         st.packed ? "packed" : "split");
+  printf("event idx  %s\n", st.event_idx ? "on" : "off");
+  printf("queues     %d\n", st.nqueue);
+  printf("cache      %s\n", st.flush ? "write-back" : "write-through");
+  printf("discard    %s\n", st.discard ? "on" : "off");
+  printf("requests   %l\n", st.requests);
+  printf("flushes    %l\n", st.flushes);
+  printf("discards   %l\n", st.discards);
+  printf("notifies   %l\n", st.notifies);
+  printf("interrupts %l\n", st.intrs);
+  if(st.requests > 0)
+    printf("per 100 requests: %d notifies, %d interrupts\n",
+           (int)(st.notifies * 100 / st.requests),
+           (int)(st.intrs * 100 / st.requests));
+  if(st.poll || st.pollhits + st.pollmisses > 0)
+    printf("polls      %l hit, %l missed\n", st.pollhits, st.pollmisses);
+  printf("waits      %l\n", st.waits);
+  for(i = 0; i < DSTAT_NHIST; i++){
+    if(st.hist[i] == 0)
+      continue;
+    if(i < DSTAT_NHIST - 1)
+      printf("  < %d cycles: %l\n", 1 << (i + 1), st.hist[i]);
+    else
+      printf("  >= %d cycles: %l\n", 1 << i, st.hist[i]);
+  }
+  exit(0);
+}
@@ -34,6 +34,8 @@ main(int argc, char *argv[])
   for(i = 0; i < 20; i++)
 //    printf(fd, "%d\n", i);
     write(fd, data, sizeof(data));
+  // the writes above were not waiting for the disk.
+  fsync(fd);
   close(fd);
 
   printf("read\n");
@@ -1,5 +1,8 @@
 struct stat;
 struct rtcdate;
+struct bcstat;
+struct dstat;
+struct fsstat;
 
 // system calls
 int fork(void);
@@ -24,6 +27,11 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int symlink(char *target, char *path);
+int bcstat(struct bcstat*, int);
+int dstat(struct dstat*, int);
+int fsync(int);
+int fdatasync(int);
+int fsstat(struct fsstat*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
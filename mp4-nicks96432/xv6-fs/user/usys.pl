@@ -37,3 +37,8 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("symlink");
+entry("bcstat");
+entry("dstat");
+entry("fsync");
+entry("fdatasync");
+entry("fsstat");